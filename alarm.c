@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <spawn.h>
+#include <time.h>
+
+#include <sys/wait.h>
+
+#include "alarm.h"
+
+extern char **environ;
+
+alarms *alarm_alloc()
+{
+  return calloc(1, sizeof(alarms));
+}
+
+void alarm_clear_rules(alarms *a)
+{
+  int i;
+
+  for (i = 0; i < a->num_rules; i++) {
+    free(a->rules[i].spec);
+  }
+  a->num_rules = 0;
+}
+
+void alarm_free(alarms *a)
+{
+  if (a == NULL) {
+    return;
+  }
+  alarm_clear_rules(a);
+  free(a->hook);
+  free(a->envp);
+  if (a->sink) {
+    sink_flush(a->sink, 0, 1);
+    sink_free(a->sink);
+  }
+  free(a);
+}
+
+/**
+ * Copies a field name from s and returns the field, or -1.
+ */
+static int field(const char **s)
+{
+  char name[32];
+  int len = 0;
+
+  while (isalnum((*s)[len]) || (*s)[len] == '_') {
+    if (len == sizeof(name) - 1) {
+      return -1;
+    }
+    name[len] = (*s)[len];
+    len++;
+  }
+  name[len] = '\0';
+  *s += len;
+  return tr_field_lookup(name);
+}
+
+/**
+ * Compiles a rule. Subjects are a field name, "rate(field)" in units per
+ * second, "imbalance" of the phase currents in percent,
+ * "deviation(field,nominal)" and "stale" in seconds without a reading.
+ */
+int alarm_add(alarms *a, const char *spec)
+{
+  alarm_rule *r;
+  const char *s = spec;
+  char *end;
+
+  if (a->num_rules == ALARM_RULES) {
+    return -1;
+  }
+  r = &a->rules[a->num_rules];
+  memset(r, 0, sizeof(alarm_rule));
+  r->address = -1;
+  r->field = -1;
+
+  if (isdigit(*s)) {
+    r->address = strtol(s, &end, 10);
+    if (*end != ':' || r->address > 255) {
+      return -1;
+    }
+    s = end + 1;
+  }
+
+  if (0 == strncmp(s, "rate(", 5)) {
+    s += 5;
+    r->kind = ALARM_RATE;
+    r->field = field(&s);
+    if (*s++ != ')') {
+      return -1;
+    }
+  } else if (0 == strncmp(s, "deviation(", 10)) {
+    s += 10;
+    r->kind = ALARM_DEVIATION;
+    r->field = field(&s);
+    if (*s++ != ',') {
+      return -1;
+    }
+    r->nominal = strtod(s, &end);
+    if (end == s || *end != ')') {
+      return -1;
+    }
+    s = end + 1;
+  } else if (0 == strncmp(s, "imbalance", 9)) {
+    s += 9;
+    r->kind = ALARM_IMBALANCE;
+  } else if (0 == strncmp(s, "stale", 5)) {
+    s += 5;
+    r->kind = ALARM_STALE;
+  } else {
+    r->kind = ALARM_FIELD;
+    r->field = field(&s);
+  }
+  if ((r->kind != ALARM_IMBALANCE && r->kind != ALARM_STALE && r->field < 0) ||
+      (*s != '<' && *s != '>')) {
+    return -1;
+  }
+  r->above = (*s++ == '>');
+
+  r->raise = strtod(s, &end);
+  if (end == s) {
+    return -1;
+  }
+  r->clear = r->raise;
+  if (*end == '/') {
+    s = end + 1;
+    r->clear = strtod(s, &end);
+    if (end == s || (r->above ? r->clear > r->raise : r->clear < r->raise)) {
+      return -1;
+    }
+  }
+  while (*end == ' ' || *end == '\t') {
+    end++;
+  }
+  if (0 == strncmp(end, "burst=", 6)) {
+    s = end + 6;
+    r->burst = strtol(s, &end, 10) * 1000LL;
+    if (end == s || r->burst <= 0) {
+      return -1;
+    }
+  }
+  if (*end != '\0' || NULL == (r->spec = strdup(spec))) {
+    return -1;
+  }
+
+  a->num_rules++;
+  return 0;
+}
+
+/**
+ * Sets the command run on state changes, or removes it if hook is NULL.
+ * The environment of the hook is allocated here, so that running it
+ * does not allocate.
+ */
+int alarm_set_hook(alarms *a, const char *hook)
+{
+  free(a->hook);
+  a->hook = NULL;
+  if (hook == NULL) {
+    return 0;
+  }
+  if (a->envp == NULL) {
+    for (a->envc = 0; environ[a->envc]; a->envc++) {
+    }
+    if (NULL == (a->envp = malloc((a->envc + 5) * sizeof(char *)))) {
+      return -1;
+    }
+    memcpy(a->envp, environ, a->envc * sizeof(char *));
+  }
+  if (NULL == (a->hook = strdup(hook))) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Sets the sink state changes are written to, or closes it if spec is
+ * NULL. A sink with the same specification stays open.
+ */
+int alarm_set_sink(alarms *a, const char *spec)
+{
+  if (a->sink) {
+    if (spec && 0 == strcmp(a->sink->spec, spec)) {
+      return 0;
+    }
+    sink_flush(a->sink, 0, 1);
+    sink_free(a->sink);
+    a->sink = NULL;
+  }
+  if (spec && NULL == (a->sink = sink_alloc(spec, 65536, NULL))) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Escapes the characters which are special in line protocol tags.
+ */
+static void escape(char *buf, int size, const char *s)
+{
+  int len = 0;
+
+  for (; *s && len < size - 2; s++) {
+    if (*s == ',' || *s == '=' || *s == ' ') {
+      buf[len++] = '\\';
+    }
+    buf[len++] = *s;
+  }
+  buf[len] = '\0';
+}
+
+/**
+ * Reaps the hooks which have finished.
+ */
+static void reap(alarms *a)
+{
+  int i;
+
+  for (i = a->num_hooks - 1; i >= 0; i--) {
+    if (waitpid(a->hooks[i], NULL, WNOHANG) != 0) {
+      a->hooks[i] = a->hooks[--a->num_hooks];
+    }
+  }
+}
+
+/**
+ * Reports a state change to the hook and the sink. The hook gets the
+ * details in its environment and is not waited for. A value of NAN
+ * means there is none, for an alarm cleared because its rule is gone.
+ */
+static void fire(alarms *a, alarm_rule *r, int n, double value, long long now)
+{
+  const char *state = r->state[n].active ? "raised" : "cleared";
+
+  if (isnan(value)) {
+    fprintf(stderr, "%d: alarm %s %s (rule removed).\n", n, r->spec, state);
+  } else {
+    fprintf(stderr, "%d: alarm %s %s (%g).\n", n, r->spec, state, value);
+  }
+
+  if (a->hook && a->num_hooks == ALARM_HOOKS) {
+    reap(a);
+  }
+  if (a->hook && a->num_hooks == ALARM_HOOKS) {
+    fprintf(stderr, "Too many alarm hooks running, not running another.\n");
+  } else if (a->hook) {
+    char address[32], rule[300], st[32], val[64];
+    char *argv[] = { "sh", "-c", a->hook, NULL };
+    char **envp = a->envp;
+    int count = a->envc;
+    pid_t pid;
+
+    snprintf(address, sizeof(address), "DSALARM_ADDRESS=%d", n);
+    snprintf(rule, sizeof(rule), "DSALARM_RULE=%s", r->spec);
+    snprintf(st, sizeof(st), "DSALARM_STATE=%s", state);
+    snprintf(val, sizeof(val), "DSALARM_VALUE=%g", value);
+    envp[count] = address;
+    envp[count + 1] = rule;
+    envp[count + 2] = st;
+    envp[count + 3] = isnan(value) ? NULL : val;
+    envp[count + 4] = NULL;
+    if (0 != posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, envp)) {
+      fprintf(stderr, "Unable to run alarm hook.\n");
+    } else {
+      a->hooks[a->num_hooks++] = pid;
+    }
+  }
+
+  if (a->sink) {
+    struct timespec stamp;
+    char tag[256];
+    char line[512];
+    int len;
+
+    clock_gettime(CLOCK_REALTIME, &stamp);
+    escape(tag, sizeof(tag), r->spec);
+    if (isnan(value)) {
+      len = snprintf(line, sizeof(line), "dsalarm,address=%d,rule=%s state=\"%s\" %lld\n",
+		     n, tag, state,
+		     (long long) stamp.tv_sec * 1000000000LL + stamp.tv_nsec);
+    } else {
+      len = snprintf(line, sizeof(line), "dsalarm,address=%d,rule=%s state=\"%s\",value=%g %lld\n",
+		     n, tag, state, value,
+		     (long long) stamp.tv_sec * 1000000000LL + stamp.tv_nsec);
+    }
+    if (len < sizeof(line)) {
+      sink_push(a->sink, line, len, now);
+      sink_flush(a->sink, now, 1);
+    }
+  }
+}
+
+/**
+ * Replaces the rules by those of from, which is left without rules, or
+ * removes them if from is NULL. A new rule with the same specification
+ * as a running one takes over its state. Alarms of rules which are gone
+ * are cleared.
+ */
+void alarm_take_rules(alarms *a, alarms *from, long long now)
+{
+  int taken[ALARM_RULES] = { 0 };
+  int i, j, n;
+
+  for (j = 0; from && j < from->num_rules; j++) {
+    for (i = 0; i < a->num_rules; i++) {
+      if (!taken[i] && 0 == strcmp(a->rules[i].spec, from->rules[j].spec)) {
+	memcpy(from->rules[j].state, a->rules[i].state, sizeof(a->rules[i].state));
+	taken[i] = 1;
+	break;
+      }
+    }
+  }
+  for (i = 0; i < a->num_rules; i++) {
+    for (n = 0; !taken[i] && n < 256; n++) {
+      if (a->rules[i].state[n].active) {
+	a->rules[i].state[n].active = 0;
+	fire(a, &a->rules[i], n, NAN, now);
+      }
+    }
+  }
+
+  alarm_clear_rules(a);
+  if (from) {
+    memcpy(a->rules, from->rules, from->num_rules * sizeof(alarm_rule));
+    a->num_rules = from->num_rules;
+    from->num_rules = 0;
+  }
+}
+
+/**
+ * Applies the hysteresis of a rule to a new value of its subject.
+ */
+static void evaluate(alarms *a, alarm_rule *r, int n, double value, long long now)
+{
+  if (!r->state[n].active) {
+    if (r->above ? value > r->raise : value < r->raise) {
+      r->state[n].active = 1;
+      fire(a, r, n, value, now);
+      if (r->burst) {
+	a->burst_address = n;
+	a->burst_length = r->burst;
+      }
+    }
+  } else if (r->above ? value <= r->clear : value >= r->clear) {
+    r->state[n].active = 0;
+    fire(a, r, n, value, now);
+  }
+}
+
+static double in_units(int field, long long value)
+{
+  return (double) value / tr_field_unit(field);
+}
+
+/**
+ * Evaluates all rules on a reading.
+ */
+void alarm_check(alarms *a, const sample *s)
+{
+  int n = s->address;
+  int i;
+
+  a->seen[n] = s->now;
+
+  for (i = 0; i < a->num_rules; i++) {
+    alarm_rule *r = &a->rules[i];
+    long long v;
+    double value;
+
+    if ((r->address >= 0 && r->address != n) ||
+	(r->field >= 0 && !(s->fields & (1 << r->field)))) {
+      continue;
+    }
+    v = (r->field >= 0) ? s->value[r->field] : 0;
+
+    switch (r->kind) {
+    case ALARM_FIELD:
+      evaluate(a, r, n, in_units(r->field, v), s->now);
+      break;
+    case ALARM_RATE:
+      if (r->state[n].time != 0 && s->now > r->state[n].time) {
+	value = in_units(r->field, v - r->state[n].value) * 1000.0 /
+	  (s->now - r->state[n].time);
+	evaluate(a, r, n, value, s->now);
+      }
+      r->state[n].value = v;
+      r->state[n].time = s->now;
+      break;
+    case ALARM_DEVIATION:
+      value = in_units(r->field, v) - r->nominal;
+      evaluate(a, r, n, value < 0 ? -value : value, s->now);
+      break;
+    case ALARM_IMBALANCE:
+      if ((s->fields & (1 << TR_CURRENT3))) {
+	long long c1 = s->value[TR_CURRENT1];
+	long long c2 = s->value[TR_CURRENT2];
+	long long c3 = s->value[TR_CURRENT3];
+	long long max = c1 > c2 ? (c1 > c3 ? c1 : c3) : (c2 > c3 ? c2 : c3);
+	long long min = c1 < c2 ? (c1 < c3 ? c1 : c3) : (c2 < c3 ? c2 : c3);
+
+	if (c1 + c2 + c3 > 0) {
+	  evaluate(a, r, n, 300.0 * (max - min) / (c1 + c2 + c3), s->now);
+	}
+      }
+      break;
+    }
+  }
+}
+
+/**
+ * Evaluates the stale rules and reaps finished hooks.
+ */
+void alarm_tick(alarms *a, long long now)
+{
+  int i, n;
+
+  reap(a);
+  if (a->sink) {
+    sink_flush(a->sink, now, 0);
+  }
+
+  for (i = 0; i < a->num_rules; i++) {
+    alarm_rule *r = &a->rules[i];
+
+    if (r->kind != ALARM_STALE) {
+      continue;
+    }
+    /* A rule for one address also covers a transducer which never
+       answered */
+    if (r->address >= 0 && a->seen[r->address] == 0) {
+      a->seen[r->address] = now;
+    }
+    for (n = 0; n < 256; n++) {
+      if (a->seen[n] != 0 && (r->address < 0 || r->address == n)) {
+	evaluate(a, r, n, (now - a->seen[n]) / 1000.0, now);
+      }
+    }
+  }
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __ALARM_H
+#define __ALARM_H
+
+#include <sys/types.h>
+
+#include "ring.h"
+#include "sink.h"
+
+/* What a rule looks at */
+#define ALARM_FIELD 0
+#define ALARM_RATE 1
+#define ALARM_IMBALANCE 2
+#define ALARM_DEVIATION 3
+#define ALARM_STALE 4
+
+#define ALARM_RULES 64
+
+/* Hooks which may run at the same time */
+#define ALARM_HOOKS 16
+
+/*
+ * A rule, compiled from "[address:]subject>raise[/clear] [burst=s]" (or
+ * "<"). The alarm is raised when the subject crosses the raise level and
+ * cleared when it crosses back over the clear level. Raising it may
+ * request a burst of the address (ms, 0 for none).
+ */
+struct alarm_rule
+{
+  char *spec;
+  int address;
+  int kind;
+  int field;
+  int above;
+  double raise;
+  double clear;
+  double nominal;
+  long long burst;
+
+  struct {
+    int active;
+    long long value;
+    long long time;
+  } state[256];
+};
+
+typedef struct alarm_rule alarm_rule;
+
+struct alarms
+{
+  int num_rules;
+  alarm_rule rules[ALARM_RULES];
+
+  /* Time of the last reading per address (poller clock), 0 if none */
+  long long seen[256];
+
+  /* Burst requested by the last raised alarm (ms, 0 if none), to be
+     passed on to the poller */
+  int burst_address;
+  long long burst_length;
+
+  /* Where state changes go: a shell command and/or a sink */
+  char *hook;
+  sink *sink;
+
+  /* Environment of the hook, the process environment followed by room
+     for the DSALARM_ variables */
+  char **envp;
+  int envc;
+
+  /* Hooks which have not been reaped yet */
+  int num_hooks;
+  pid_t hooks[ALARM_HOOKS];
+};
+
+typedef struct alarms alarms;
+
+alarms *alarm_alloc();
+void alarm_free(alarms *a);
+int alarm_add(alarms *a, const char *spec);
+void alarm_clear_rules(alarms *a);
+void alarm_take_rules(alarms *a, alarms *from, long long now);
+int alarm_set_hook(alarms *a, const char *hook);
+int alarm_set_sink(alarms *a, const char *spec);
+void alarm_check(alarms *a, const sample *s);
+void alarm_tick(alarms *a, long long now);
+
+#endif /* __ALARM_H */
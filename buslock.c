@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "buslock.h"
+#include "timer.h"
+
+struct entry
+{
+  int pid;
+  unsigned id;
+};
+
+void lock_init(buslock *l)
+{
+  static unsigned ids = 0;
+
+  l->device = -1;
+  l->fd = -1;
+  l->id = __atomic_add_fetch(&ids, 1, __ATOMIC_RELAXED);
+  l->depth = 0;
+  l->wait = LOCK_WAIT_DEFAULT;
+}
+
+/**
+ * Builds the name of a file in dir which belongs to a device, e.g.
+ * /var/lock/dstransducer.dev_ttyUSB0 for /dev/ttyUSB0 or any link to it,
+ * followed by suffix. Returns LOCK_ERROR if the device does not exist.
+ */
+int lock_path(char *file, int size, const char *dir, const char *device,
+	      const char *suffix)
+{
+  char real[PATH_MAX];
+  char *c;
+
+  if (NULL == realpath(device, real)) {
+    return LOCK_ERROR;
+  }
+  for (c = real; *c; c++) {
+    if (*c == '/') {
+      *c = '_';
+    }
+  }
+  if (snprintf(file, size, "%s/dstransducer.%s%s", dir, real + 1, suffix) >= size) {
+    return LOCK_ERROR;
+  }
+  return LOCK_OK;
+}
+
+/**
+ * Shares the bus of device, opened as fd, with other processes. The queue
+ * file is created with the umask of the first user, so that whether
+ * others may queue up is up to the administrator.
+ */
+int lock_open(buslock *l, const char *device, int fd)
+{
+  char file[PATH_MAX + 32];
+
+  if (LOCK_OK != lock_path(file, sizeof(file), LOCK_DIR, device, "")) {
+    return LOCK_ERROR;
+  }
+  l->device = fd;
+  l->fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0666);
+  return LOCK_OK;
+}
+
+void lock_close(buslock *l)
+{
+  if (l->device >= 0) {
+    while (l->depth > 0) {
+      lock_release(l);
+    }
+    if (l->fd >= 0) {
+      close(l->fd);
+    }
+    l->device = -1;
+    l->fd = -1;
+  }
+}
+
+/**
+ * Reads the queue, with the file locked, and drops dead processes.
+ * Returns the number of entries left, and in dropped whether there were
+ * dead ones.
+ */
+static int queue_read(buslock *l, struct entry *q, int *dropped)
+{
+  int len;
+  int i, n = 0;
+
+  if (0 != flock(l->fd, LOCK_EX)) {
+    return -1;
+  }
+  len = pread(l->fd, q, LOCK_QUEUE_MAX * sizeof(struct entry), 0);
+  len = (len < 0) ? 0 : len / sizeof(struct entry);
+
+  for (i = 0; i < len; i++) {
+    if (q[i].pid > 0 && (0 == kill(q[i].pid, 0) || errno != ESRCH)) {
+      q[n++] = q[i];
+    }
+  }
+  *dropped = (n < len);
+  return n;
+}
+
+/**
+ * Writes the queue back, if it changed, and unlocks the file.
+ */
+static void queue_write(buslock *l, struct entry *q, int n, int changed)
+{
+  if (changed) {
+    if (n > 0) {
+      pwrite(l->fd, q, n * sizeof(struct entry), 0);
+    }
+    ftruncate(l->fd, n * sizeof(struct entry));
+  }
+  flock(l->fd, LOCK_UN);
+}
+
+static int queue_find(buslock *l, struct entry *q, int n)
+{
+  int pid = getpid();
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (q[i].pid == pid && q[i].id == l->id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void queue_remove(buslock *l)
+{
+  struct entry q[LOCK_QUEUE_MAX];
+  int dropped;
+  int n = queue_read(l, q, &dropped);
+  int i = queue_find(l, q, n);
+
+  if (n < 0) {
+    return;
+  }
+  if (i >= 0) {
+    memmove(q + i, q + i + 1, (n - i - 1) * sizeof(struct entry));
+    n--;
+  }
+  queue_write(l, q, n, dropped || i >= 0);
+}
+
+/**
+ * Takes the device lock, without waiting.
+ */
+static int device_try(buslock *l)
+{
+  if (0 == flock(l->device, LOCK_EX | LOCK_NB)) {
+    l->depth = 1;
+    return LOCK_OK;
+  }
+  return (errno == EWOULDBLOCK || errno == EINTR) ? LOCK_WAIT : LOCK_ERROR;
+}
+
+/**
+ * Gets in line for the bus, or looks whether it is this handle's turn,
+ * without waiting. Returns LOCK_OK once the handle is first in line, and
+ * LOCK_WAIT while others are ahead of it. Nested calls only count.
+ */
+int lock_try(buslock *l)
+{
+  struct entry q[LOCK_QUEUE_MAX];
+  int changed;
+  int n;
+
+  if (l->device < 0 || l->depth > 0) {
+    l->depth++;
+    return LOCK_OK;
+  }
+  if (l->fd < 0) {
+    return device_try(l);
+  }
+
+  if (0 > (n = queue_read(l, q, &changed))) {
+    return LOCK_ERROR;
+  }
+  if (queue_find(l, q, n) < 0) {
+    /* Not in line yet, or dropped by someone else */
+    if (n == LOCK_QUEUE_MAX) {
+      queue_write(l, q, n, changed);
+      return LOCK_ERROR;
+    }
+    q[n].pid = getpid();
+    q[n].id = l->id;
+    n++;
+    changed = 1;
+  }
+  queue_write(l, q, n, changed);
+
+  if (q[0].pid == getpid() && q[0].id == l->id) {
+    /* Processes without a queue may still hold the device. Leave the
+       line on errors, so that others are not held up behind us. */
+    int rc = device_try(l);
+
+    if (rc == LOCK_ERROR) {
+      queue_remove(l);
+    }
+    return rc;
+  }
+  return LOCK_WAIT;
+}
+
+/**
+ * Leaves the line after lock_try() returned LOCK_WAIT.
+ */
+void lock_cancel(buslock *l)
+{
+  if (l->fd >= 0 && l->device >= 0 && l->depth == 0) {
+    queue_remove(l);
+  }
+}
+
+/**
+ * Waits until the bus is free and this handle is first in line, for at
+ * most l->wait ms. Leaves the line unless the bus was acquired. Nested
+ * calls only count.
+ */
+int lock_acquire(buslock *l)
+{
+  long long deadline = timer_now_ms() + l->wait;
+  int rc;
+
+  while (LOCK_WAIT == (rc = lock_try(l))) {
+    if (timer_now_ms() >= deadline) {
+      rc = LOCK_TIMEOUT;
+      break;
+    }
+    timer_sleep_ms(LOCK_POLL);
+  }
+  if (rc != LOCK_OK) {
+    lock_cancel(l);
+  }
+  return rc;
+}
+
+/**
+ * Releases the bus, letting the next one in line go.
+ */
+void lock_release(buslock *l)
+{
+  if (l->depth == 0 || --l->depth > 0 || l->device < 0) {
+    return;
+  }
+  flock(l->device, LOCK_UN);
+  if (l->fd >= 0) {
+    queue_remove(l);
+  }
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __BUSLOCK_H
+#define __BUSLOCK_H
+
+#define LOCK_OK 0
+#define LOCK_ERROR -1
+#define LOCK_TIMEOUT -2
+#define LOCK_WAIT -3
+
+/* Default time to wait for the bus, in ms */
+#define LOCK_WAIT_DEFAULT 5000
+
+/* Directory of the queue files, the same for all users of a bus */
+#define LOCK_DIR "/var/lock"
+
+/* Interval at which a waiting handle looks at the queue again (ms) */
+#define LOCK_POLL 2
+
+/* Processes which may wait for a bus at the same time */
+#define LOCK_QUEUE_MAX 64
+
+/*
+ * Exclusive access to a bus, for one transaction at a time. The device
+ * itself is flocked while the bus is held. Waiting handles are served in
+ * FIFO order, also across processes: they queue up in a small file in
+ * LOCK_DIR, which is only locked while the queue is updated. Entries of
+ * dead processes are dropped. A process which may not write the queue
+ * file only takes the device lock, whenever it is free.
+ */
+struct buslock
+{
+  /* Device, -1 if the bus is not shared (e.g. a replay), and the queue
+     file, -1 if there is none */
+  int device;
+  int fd;
+  unsigned id;
+  int depth;
+
+  /* Maximum wait in ms */
+  int wait;
+};
+
+typedef struct buslock buslock;
+
+void lock_init(buslock *l);
+int lock_path(char *file, int size, const char *dir, const char *device,
+	      const char *suffix);
+int lock_open(buslock *l, const char *device, int fd);
+void lock_close(buslock *l);
+int lock_try(buslock *l);
+void lock_cancel(buslock *l);
+int lock_acquire(buslock *l);
+void lock_release(buslock *l);
+
+#endif /* __BUSLOCK_H */
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "timer.h"
+
+/* Outcomes of load() */
+#define FRESH 1
+#define STALE 0
+#define EMPTY -1
+
+/**
+ * Opens the cache file of address n. Only the owner of CACHE_DIR creates
+ * and writes the files (owner is set for it), everybody else only reads
+ * them, and only if the owner wrote them and nobody else may.
+ */
+static int cache_open(const char *device, int n, int *owner)
+{
+  char file[PATH_MAX + 32];
+  char suffix[8];
+  struct stat dir, st;
+  int fd;
+
+  if (0 != stat(CACHE_DIR, &dir)) {
+    mkdir(CACHE_DIR, 0755);
+    if (0 != stat(CACHE_DIR, &dir)) {
+      return -1;
+    }
+  }
+  if (!S_ISDIR(dir.st_mode) || (dir.st_mode & (S_IWGRP | S_IWOTH))) {
+    return -1;
+  }
+  *owner = (dir.st_uid == geteuid());
+
+  snprintf(suffix, sizeof(suffix), ".%d", n);
+  if (LOCK_OK != lock_path(file, sizeof(file), CACHE_DIR, device, suffix)) {
+    return -1;
+  }
+  if (*owner) {
+    fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+  } else {
+    fd = open(file, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  if (0 != fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != dir.st_uid ||
+      (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Returns the factor by which a field grows with the current and voltage
+ * transformer ratios.
+ */
+static double ratio_of(int field, double ct, double pt)
+{
+  switch (field) {
+  case TR_VOLTAGE1:
+  case TR_VOLTAGE2:
+  case TR_VOLTAGE3:
+    return pt;
+  case TR_CURRENT1:
+  case TR_CURRENT2:
+  case TR_CURRENT3:
+    return ct;
+  case TR_PFACTOR:
+  case TR_FREQUENCY:
+    return 1;
+  default:
+    return ct * pt;
+  }
+}
+
+/**
+ * Reads the cached reading of transducer n into the handle, scaled to
+ * the handle's transformer ratios. Returns FRESH if it is at most
+ * max_age ms old, STALE if it is older, in which case only the model is
+ * of use, or EMPTY.
+ */
+static int load(int fd, transducer *t, int n, long long max_age, long long *stamp)
+{
+  char buf[512];
+  char *s, *e;
+  long long v[TR_FIELDS + 4];
+  double ct = 1, pt = 1;
+  int len;
+  int k;
+
+  if (0 >= (len = pread(fd, buf, sizeof(buf) - 1, 0))) {
+    return EMPTY;
+  }
+  buf[len] = '\0';
+  if (0 != strncmp(buf, CACHE_MAGIC " ", 9)) {
+    return EMPTY;
+  }
+  for (s = buf + 9, k = 0; k < TR_FIELDS + 4; k++, s = e) {
+    v[k] = strtoll(s, &e, 10);
+    if (e == s) {
+      return EMPTY;
+    }
+    /* The ratios follow the model */
+    if (k == 3 && (0 >= (ct = strtod(e, &e)) || 0 >= (pt = strtod(e, &e)))) {
+      return EMPTY;
+    }
+  }
+  if (TR_OK != tr_set_model(t, n, v[1], v[2], v[3])) {
+    return EMPTY;
+  }
+  for (k = 0; k < TR_FIELDS; k++) {
+    double r = ratio_of(k, t->transducers[n].ct, t->transducers[n].pt) / ratio_of(k, ct, pt);
+
+    t->value[k][n] = (r == 1) ? v[k + 4] : llround(v[k + 4] * r);
+  }
+  *stamp = v[0];
+  return (timer_wall_ns() - v[0] <= max_age * 1000000LL) ? FRESH : STALE;
+}
+
+/**
+ * Writes a reading of a transducer of the given model, scaled with
+ * transformer ratios ct and pt.
+ */
+static void store(int fd, long long stamp, int type, int max_volts, int max_amps,
+		  double ct, double pt, const long long *value)
+{
+  char buf[512];
+  int len;
+  int k;
+
+  len = snprintf(buf, sizeof(buf), "%s %lld %d %d %d %.17g %.17g", CACHE_MAGIC, stamp,
+		 type, max_volts, max_amps, ct, pt);
+  for (k = 0; k < TR_FIELDS; k++) {
+    len += snprintf(buf + len, sizeof(buf) - len, " %lld", value[k]);
+  }
+  len += snprintf(buf + len, sizeof(buf) - len, "\n");
+  if (len == pwrite(fd, buf, len, 0)) {
+    ftruncate(fd, len);
+  }
+}
+
+/**
+ * Writes the reading of transducer n in the handle.
+ */
+static void store_handle(int fd, transducer *t, int n, long long stamp)
+{
+  long long value[TR_FIELDS];
+  int k;
+
+  for (k = 0; k < TR_FIELDS; k++) {
+    value[k] = t->value[k][n];
+  }
+  store(fd, stamp, t->transducers[n].type, t->transducers[n].max_volts,
+	t->transducers[n].max_amps, t->transducers[n].ct, t->transducers[n].pt, value);
+}
+
+/**
+ * Reads transducer n from the bus. The model is only asked for if it is
+ * not known, or if reading with the known one fails.
+ */
+static int fetch(transducer *t, int n, int known)
+{
+  int result;
+
+  if (known && TR_OK == tr_read(t, n) && TR_OK == tr_read_energy(t, n)) {
+    return TR_OK;
+  }
+  if (TR_OK != (result = tr_identify(t, n))) {
+    return result;
+  }
+  if (TR_OK != (result = tr_read(t, n))) {
+    return result;
+  }
+  return tr_read_energy(t, n);
+}
+
+/**
+ * Gets the values of transducer n from the cache if they are at most
+ * max_age ms old, or else from the bus. A process which finds the cache
+ * being refreshed waits for the new reading instead of reading the
+ * transducer itself. Returns the result of reading the transducer, and
+ * the wall clock time (ns) of the reading in stamp.
+ */
+int cache_read(transducer *t, const char *device, int n, long long max_age,
+	       long long *stamp)
+{
+  int owner;
+  int fd = cache_open(device, n, &owner);
+  int result;
+  int cached;
+
+  if (fd < 0) {
+    /* No cache, e.g. not allowed to create the file */
+    *stamp = timer_wall_ns();
+    return fetch(t, n, 0);
+  }
+
+  flock(fd, LOCK_SH);
+  cached = load(fd, t, n, max_age, stamp);
+  flock(fd, LOCK_UN);
+
+  if (cached != FRESH && !owner) {
+    /* Not allowed to refresh the cache */
+    close(fd);
+    *stamp = timer_wall_ns();
+    return fetch(t, n, cached == STALE);
+  }
+  if (cached != FRESH) {
+    /* Whoever holds the lock is reading the transducer, look again once
+       it is done */
+    flock(fd, LOCK_EX);
+    if (FRESH != (cached = load(fd, t, n, max_age, stamp))) {
+      *stamp = timer_wall_ns();
+      if (TR_OK == (result = fetch(t, n, cached == STALE))) {
+	store_handle(fd, t, n, *stamp);
+      }
+      flock(fd, LOCK_UN);
+      close(fd);
+      return result;
+    }
+    flock(fd, LOCK_UN);
+  }
+  close(fd);
+  return TR_OK;
+}
+
+cache *cache_alloc(const char *device)
+{
+  cache *c;
+  int n;
+
+  if (NULL == (c = malloc(sizeof(cache)))) {
+    return NULL;
+  }
+  if (NULL == (c->device = strdup(device))) {
+    free(c);
+    return NULL;
+  }
+  for (n = 0; n < 256; n++) {
+    c->fd[n] = -1;
+    c->stamp[n] = 0;
+  }
+  return c;
+}
+
+void cache_free(cache *c)
+{
+  int n;
+
+  if (c == NULL) {
+    return;
+  }
+  for (n = 0; n < 256; n++) {
+    if (c->fd[n] >= 0) {
+      close(c->fd[n]);
+    }
+  }
+  free(c->device);
+  free(c);
+}
+
+/**
+ * Stores a reading, unless a newer one was stored already. The file of
+ * the address is opened with its first reading and stays open. Skipped
+ * if somebody else is refreshing it right now, rather than waiting for
+ * them.
+ */
+void cache_store(cache *c, const sample *s)
+{
+  long long value[TR_FIELDS];
+  int n = s->address;
+  int owner;
+  int k;
+
+  if (c->fd[n] == -1) {
+    c->fd[n] = cache_open(c->device, n, &owner);
+    if (c->fd[n] >= 0 && !owner) {
+      close(c->fd[n]);
+      c->fd[n] = -2;
+    } else if (c->fd[n] < 0) {
+      c->fd[n] = -2;
+    }
+  }
+  if (c->fd[n] < 0 || s->stamp <= c->stamp[n]) {
+    return;
+  }
+  for (k = 0; k < TR_FIELDS; k++) {
+    value[k] = (s->fields & (1 << k)) ? s->value[k] : 0;
+  }
+  if (0 == flock(c->fd[n], LOCK_EX | LOCK_NB)) {
+    store(c->fd[n], s->stamp, s->type, s->max_volts, s->max_amps, s->ct, s->pt, value);
+    flock(c->fd[n], LOCK_UN);
+    c->stamp[n] = s->stamp;
+  }
+}
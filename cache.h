@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include "transducer.h"
+#include "ring.h"
+
+#define CACHE_MAGIC "DSCACHE2"
+
+/* Directory of the cache files, owned by the user of the poller */
+#define CACHE_DIR "/var/cache/dstransducer"
+
+/*
+ * The last reading of every address is kept in a small file in CACHE_DIR,
+ * e.g. /var/cache/dstransducer/dstransducer.dev_ttyUSB0.7 for address 7,
+ * as one line: the magic, the wall clock time of the reading (ns since
+ * the epoch), the model (type, max volts, max amps), the current and
+ * voltage transformer ratios the fields were scaled with, and all fields
+ * in engineering units. Readers with other ratios scale the fields over.
+ * Readers hold a shared lock on the file, the process refreshing it an
+ * exclusive one, so that processes asking for the same address at the
+ * same time wait for one reading instead of taking turns on the bus.
+ * Only processes of the owner of CACHE_DIR write the files, the others
+ * read them without refreshing them.
+ */
+int cache_read(transducer *t, const char *device, int n, long long max_age,
+	       long long *stamp);
+
+/*
+ * The cache files of a device as written by a poller, which keeps them
+ * open.
+ */
+struct cache
+{
+  char *device;
+
+  /* Per address: the open file, -1 if not opened yet, -2 if it may not
+     be written */
+  int fd[256];
+
+  /* Time of the last reading stored (wall clock, ns) */
+  long long stamp[256];
+};
+
+typedef struct cache cache;
+
+cache *cache_alloc(const char *device);
+void cache_free(cache *c);
+void cache_store(cache *c, const sample *s);
+
+#endif /* __CACHE_H */
@@ -0,0 +1,768 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+#include "conf.h"
+#include "publisher.h"
+
+/**
+ * Parses a transformer ratio, either as a number or as "primary/secondary".
+ */
+double conf_parse_ratio(const char *s)
+{
+  double a, b;
+
+  if (2 == sscanf(s, "%lf/%lf", &a, &b) && b > 0) {
+    return a / b;
+  }
+  return atof(s);
+}
+
+/**
+ * Parses a range of milliseconds "min-max".
+ */
+int conf_parse_range(const char *s, int *min, int *max)
+{
+  if (2 != sscanf(s, "%d-%d", min, max) || *min <= 0 || *max < *min) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Parses a duration given as "5", "5s" or "500ms", and returns it in ms,
+ * or -1 if it is invalid.
+ */
+long long conf_parse_ms(const char *s)
+{
+  char *end;
+  long long v = strtoll(s, &end, 10);
+
+  if (end == s || v < 0) {
+    return -1;
+  } else if (*end == '\0' || 0 == strcmp(end, "s")) {
+    return v * 1000;
+  } else if (0 == strcmp(end, "ms")) {
+    return v;
+  }
+  return -1;
+}
+
+static char *trim(char *s)
+{
+  char *e;
+
+  while (isspace(*s)) {
+    s++;
+  }
+  e = s + strlen(s);
+  while (e > s && isspace(e[-1])) {
+    *--e = '\0';
+  }
+  return s;
+}
+
+static int yes(const char *s)
+{
+  return 0 == strcmp(s, "yes") || 0 == strcmp(s, "1") || 0 == strcmp(s, "on");
+}
+
+/**
+ * Parses "meter: address [interval=s] [ct=ratio] [pt=ratio] [fast]".
+ */
+static int parse_meter(conf *c, char *value)
+{
+  char *save;
+  char *tok;
+  int m = c->num_meters;
+
+  if (m == 256 || NULL == (tok = strtok_r(value, " \t", &save))) {
+    return -1;
+  }
+  c->meters[m].address = atoi(tok);
+  c->meters[m].interval = 0;
+  c->meters[m].ct = 1.0;
+  c->meters[m].pt = 1.0;
+  c->meters[m].fast = 0;
+  if (c->meters[m].address < 0 || c->meters[m].address > 255) {
+    return -1;
+  }
+
+  while (NULL != (tok = strtok_r(NULL, " \t", &save))) {
+    if (0 == strncmp(tok, "interval=", 9)) {
+      c->meters[m].interval = atoi(tok + 9) * 1000LL;
+    } else if (0 == strncmp(tok, "ct=", 3)) {
+      c->meters[m].ct = conf_parse_ratio(tok + 3);
+    } else if (0 == strncmp(tok, "pt=", 3)) {
+      c->meters[m].pt = conf_parse_ratio(tok + 3);
+    } else if (0 == strcmp(tok, "fast")) {
+      c->meters[m].fast = 1;
+    } else {
+      return -1;
+    }
+  }
+  if (c->meters[m].interval < 0 || !tr_valid_ratio(c->meters[m].ct, c->meters[m].pt)) {
+    return -1;
+  }
+
+  c->num_meters++;
+  return 0;
+}
+
+/**
+ * Parses "group: name=address,address,... [interval=s]".
+ */
+static int parse_group(conf *c, char *value)
+{
+  char *save;
+  char *tok;
+  int g = c->num_groups;
+
+  if (g == POLLER_GROUPS || NULL == (tok = strtok_r(value, " \t", &save)) ||
+      0 != poller_check_group(tok)) {
+    return -1;
+  }
+  c->groups[g].spec = strdup(tok);
+  c->groups[g].interval = 0;
+  c->num_groups++;
+  while (NULL != (tok = strtok_r(NULL, " \t", &save))) {
+    if (0 == strncmp(tok, "interval=", 9)) {
+      c->groups[g].interval = atoi(tok + 9) * 1000LL;
+    } else {
+      return -1;
+    }
+  }
+  return (c->groups[g].interval >= 0) ? 0 : -1;
+}
+
+static int parse_line(conf *c, char *key, char *value)
+{
+  if (0 == strcmp(key, "device")) {
+    free(c->device);
+    c->device = strdup(value);
+  } else if (0 == strcmp(key, "dsreadout")) {
+    /* Used by the SNMP helper only */
+  } else if (0 == strcmp(key, "meter")) {
+    return parse_meter(c, value);
+  } else if (0 == strcmp(key, "group")) {
+    return parse_group(c, value);
+  } else if (0 == strcmp(key, "virtual")) {
+    if (c->num_virtuals == POLLER_VIRTUALS || 0 != poller_check_virtual(value)) {
+      return -1;
+    }
+    c->virtuals[c->num_virtuals++] = strdup(value);
+  } else if (0 == strcmp(key, "interval")) {
+    c->interval = atoi(value) * 1000LL;
+    return (c->interval > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "deadband")) {
+    c->num_deadbands++;
+    return deadband_set(&c->deadband, value);
+  } else if (0 == strcmp(key, "heartbeat")) {
+    c->heartbeat = atoi(value) * 1000LL;
+    return (c->heartbeat >= 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "discover")) {
+    c->discover = yes(value);
+  } else if (0 == strcmp(key, "probe-timeout")) {
+    c->probe_timeout = atoi(value);
+    return (c->probe_timeout > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "age-out")) {
+    c->age_out = atoi(value) * 1000LL;
+    return (c->age_out >= 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "failures")) {
+    c->failures = atoi(value);
+    return (c->failures > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "max-backoff")) {
+    c->max_backoff = atoi(value) * 1000LL;
+    return (c->max_backoff > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "auto-timeout")) {
+    return conf_parse_range(value, &c->timeout_min, &c->timeout_max);
+  } else if (0 == strcmp(key, "baud")) {
+    c->baud = atoi(value);
+    return (c->baud > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "state")) {
+    free(c->state);
+    c->state = strdup(value);
+  } else if (0 == strcmp(key, "state-interval")) {
+    c->state_interval = atoi(value) * 1000LL;
+    return (c->state_interval > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "cache")) {
+    c->cache = yes(value);
+  } else if (0 == strcmp(key, "control")) {
+    free(c->control);
+    c->control = strdup(value);
+  } else if (0 == strcmp(key, "burst-dir")) {
+    free(c->burst_dir);
+    c->burst_dir = strdup(value);
+  } else if (0 == strcmp(key, "burst-keepalive")) {
+    c->burst_keepalive = atoi(value) * 1000LL;
+    return (c->burst_keepalive > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "alarm")) {
+    if (c->alarms == NULL && NULL == (c->alarms = alarm_alloc())) {
+      return -1;
+    }
+    return alarm_add(c->alarms, value);
+  } else if (0 == strcmp(key, "alarm-hook")) {
+    free(c->alarm_hook);
+    c->alarm_hook = strdup(value);
+  } else if (0 == strcmp(key, "alarm-sink")) {
+    free(c->alarm_sink);
+    c->alarm_sink = strdup(value);
+  } else if (0 == strcmp(key, "sink")) {
+    if (c->num_sinks == 16) {
+      return -1;
+    }
+    c->sinks[c->num_sinks++] = strdup(value);
+  } else if (0 == strcmp(key, "batch-size")) {
+    c->batch_size = atoi(value);
+    return (c->batch_size > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "batch-age")) {
+    c->batch_age = atoi(value);
+    return (c->batch_age >= 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "sink-buffer")) {
+    c->sink_buffer = atoi(value);
+    return (c->sink_buffer > 0) ? 0 : -1;
+  } else if (0 == strcmp(key, "spill")) {
+    free(c->spill);
+    c->spill = strdup(value);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Reads a configuration file of "key: value" lines and compiles its
+ * deadbands and alarm rules. Returns NULL if the file cannot be read or
+ * contains errors, which are reported on stderr.
+ */
+conf *conf_load(const char *file)
+{
+  char buf[1024];
+  int errors = 0;
+  int line = 0;
+  FILE *f;
+  conf *c;
+
+  if (NULL == (f = fopen(file, "r"))) {
+    fprintf(stderr, "Unable to open configuration `%s'.\n", file);
+    return NULL;
+  }
+  if (NULL == (c = calloc(1, sizeof(conf)))) {
+    fclose(f);
+    return NULL;
+  }
+  c->interval = -1;
+  c->heartbeat = -1;
+  c->discover = -1;
+  c->probe_timeout = -1;
+  c->age_out = -1;
+  c->failures = -1;
+  c->max_backoff = -1;
+  c->timeout_min = -1;
+  c->timeout_max = -1;
+  c->baud = -1;
+  c->state_interval = -1;
+  c->burst_keepalive = -1;
+  c->cache = -1;
+  c->batch_size = -1;
+  c->batch_age = -1;
+  c->sink_buffer = -1;
+
+  while (fgets(buf, sizeof(buf), f)) {
+    char *l;
+    char *colon;
+
+    line++;
+    if (NULL != (l = strchr(buf, '#'))) {
+      *l = '\0';
+    }
+    l = trim(buf);
+    if (*l == '\0') {
+      continue;
+    }
+
+    if (NULL == (colon = strchr(l, ':'))) {
+      fprintf(stderr, "%s:%d: invalid line.\n", file, line);
+      errors++;
+      continue;
+    }
+    *colon = '\0';
+    if (0 != parse_line(c, trim(l), trim(colon + 1))) {
+      fprintf(stderr, "%s:%d: invalid line.\n", file, line);
+      errors++;
+    }
+  }
+  fclose(f);
+
+  if (errors) {
+    conf_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+void conf_free(conf *c)
+{
+  int i;
+
+  for (i = 0; i < c->num_sinks; i++) {
+    free(c->sinks[i]);
+  }
+  for (i = 0; i < c->num_groups; i++) {
+    free(c->groups[i].spec);
+  }
+  for (i = 0; i < c->num_virtuals; i++) {
+    free(c->virtuals[i]);
+  }
+  alarm_free(c->alarms);
+  free(c->alarm_hook);
+  free(c->alarm_sink);
+  free(c->device);
+  free(c->state);
+  free(c->control);
+  free(c->burst_dir);
+  free(c->spill);
+  free(c);
+}
+
+static void apply_meters(conf *c, poller *p)
+{
+  int i, j;
+
+  /* Drop configured meters which are gone from the file, unless they
+     are still members of a group */
+  for (i = p->num_meters - 1; i >= 0; i--) {
+    if (p->meters[i].origin != POLLER_CONF || p->meters[i].group >= 0) {
+      continue;
+    }
+    for (j = 0; j < c->num_meters; j++) {
+      if (c->meters[j].address == p->meters[i].address) {
+	break;
+      }
+    }
+    if (j == c->num_meters) {
+      poller_remove_meter(p, i);
+    }
+  }
+
+  for (j = 0; j < c->num_meters; j++) {
+    int n = c->meters[j].address;
+
+    i = poller_add_meter(p, n, POLLER_CONF);
+    p->meters[i].origin = POLLER_CONF;
+    p->meters[i].interval = c->meters[j].interval;
+    if (p->meters[i].fast != c->meters[j].fast) {
+      p->meters[i].fast = c->meters[j].fast;
+      p->meters[i].sampled = 0;
+      p->meters[i].reconcile = 0;
+    }
+
+    if (p->t->transducers[n].ct != c->meters[j].ct ||
+	p->t->transducers[n].pt != c->meters[j].pt) {
+      tr_set_ratio(p->t, n, c->meters[j].ct, c->meters[j].pt);
+      publish_forget(p, n);
+    }
+  }
+}
+
+/**
+ * Returns true if spec ("name=...") defines the given name.
+ */
+static int defines(const char *spec, const char *name)
+{
+  int len = strlen(name);
+
+  return 0 == strncmp(spec, name, len) && spec[len] == '=';
+}
+
+static void apply_groups(conf *c, poller *p)
+{
+  int g, j;
+
+  /* Drop configured groups which are gone from the file */
+  for (g = p->num_groups - 1; g >= 0; g--) {
+    if (p->groups[g].origin != POLLER_CONF) {
+      continue;
+    }
+    for (j = 0; j < c->num_groups; j++) {
+      if (defines(c->groups[j].spec, p->groups[g].name)) {
+	break;
+      }
+    }
+    if (j == c->num_groups) {
+      poller_remove_group(p, g);
+    }
+  }
+
+  for (j = 0; j < c->num_groups; j++) {
+    if (0 > poller_add_group(p, c->groups[j].spec, c->groups[j].interval, POLLER_CONF)) {
+      publish_message(p, "Invalid group `%s'.\n", c->groups[j].spec);
+    }
+  }
+}
+
+static void apply_virtuals(conf *c, poller *p)
+{
+  int v, j;
+
+  for (v = p->num_virtuals - 1; v >= 0; v--) {
+    if (p->virtuals[v].origin != POLLER_CONF) {
+      continue;
+    }
+    for (j = 0; j < c->num_virtuals; j++) {
+      if (defines(c->virtuals[j], p->virtuals[v].name)) {
+	break;
+      }
+    }
+    if (j == c->num_virtuals) {
+      poller_remove_virtual(p, v);
+    }
+  }
+
+  for (j = 0; j < c->num_virtuals; j++) {
+    if (0 > poller_add_virtual(p, c->virtuals[j], POLLER_CONF)) {
+      publish_message(p, "Invalid virtual meter `%s'.\n", c->virtuals[j]);
+    }
+  }
+}
+
+static void apply_sinks(conf *c, poller *p)
+{
+  sink **s;
+  int i;
+
+  /* Close configured sinks which are gone from the file */
+  s = &p->sinks;
+  while (*s) {
+    for (i = 0; i < c->num_sinks; i++) {
+      if (0 == strcmp((*s)->spec, c->sinks[i])) {
+	break;
+      }
+    }
+    if ((*s)->configured && i == c->num_sinks) {
+      sink *gone = *s;
+      *s = gone->next;
+      sink_flush(gone, 0, 1);
+      sink_free(gone);
+    } else {
+      s = &(*s)->next;
+    }
+  }
+
+  for (i = 0; i < c->num_sinks; i++) {
+    sink *n;
+
+    for (n = p->sinks; n; n = n->next) {
+      if (n->configured && 0 == strcmp(n->spec, c->sinks[i])) {
+	break;
+      }
+    }
+    if (n == NULL) {
+      n = sink_alloc(c->sinks[i], c->sink_buffer, c->spill);
+      if (n == NULL) {
+	fprintf(stderr, "Unable to create sink `%s'.\n", c->sinks[i]);
+	continue;
+      }
+      n->configured = 1;
+      poller_add_sink(p, n);
+    }
+    n->batch_size = c->batch_size;
+    n->batch_age = c->batch_age;
+  }
+}
+
+/**
+ * Returns the settings of a poller whose configuration file has not been
+ * applied yet, as a configuration.
+ */
+static conf *current_settings(poller *p)
+{
+  conf *d;
+  int i;
+
+  if (NULL == (d = calloc(1, sizeof(conf)))) {
+    return NULL;
+  }
+  d->interval = p->interval;
+  d->heartbeat = p->deadband.heartbeat;
+  d->discover = p->discover;
+  d->probe_timeout = p->probe_timeout;
+  d->age_out = p->age_out;
+  d->failures = p->failures_max;
+  d->max_backoff = p->backoff_max;
+  d->timeout_min = p->t->timeout_min;
+  d->timeout_max = p->t->timeout_max;
+  d->baud = -1;
+  d->state_interval = p->state_interval;
+  d->burst_keepalive = p->burst_keepalive;
+  d->cache = p->cache;
+  d->batch_size = p->sink_batch_size;
+  d->batch_age = p->sink_batch_age;
+  d->sink_buffer = p->sink_buffer;
+  if (p->spill && NULL == (d->spill = strdup(p->spill))) {
+    conf_free(d);
+    return NULL;
+  }
+  memcpy(d->deadband.abs, p->deadband.abs, sizeof(d->deadband.abs));
+  memcpy(d->deadband.pct, p->deadband.pct, sizeof(d->deadband.pct));
+
+  if (p->alarms) {
+    if (p->alarms->num_rules > 0 && NULL == (d->alarms = alarm_alloc())) {
+      conf_free(d);
+      return NULL;
+    }
+    for (i = 0; i < p->alarms->num_rules; i++) {
+      if (0 != alarm_add(d->alarms, p->alarms->rules[i].spec)) {
+	conf_free(d);
+	return NULL;
+      }
+    }
+    if ((p->alarms->hook && NULL == (d->alarm_hook = strdup(p->alarms->hook))) ||
+	(p->alarms->sink && NULL == (d->alarm_sink = strdup(p->alarms->sink->spec)))) {
+      conf_free(d);
+      return NULL;
+    }
+  }
+  return d;
+}
+
+/**
+ * Fills in the settings which do not appear in a configuration file from
+ * the defaults d. Meters, groups, virtual meters and sinks are not taken
+ * over, those from the file are added to the others.
+ */
+static int merge(conf *c, const conf *d)
+{
+  int i;
+
+  if (c->interval < 0) {
+    c->interval = d->interval;
+  }
+  if (c->heartbeat < 0) {
+    c->heartbeat = d->heartbeat;
+  }
+  if (c->discover < 0) {
+    c->discover = d->discover;
+  }
+  if (c->probe_timeout < 0) {
+    c->probe_timeout = d->probe_timeout;
+  }
+  if (c->age_out < 0) {
+    c->age_out = d->age_out;
+  }
+  if (c->failures < 0) {
+    c->failures = d->failures;
+  }
+  if (c->max_backoff < 0) {
+    c->max_backoff = d->max_backoff;
+  }
+  if (c->timeout_min < 0) {
+    c->timeout_min = d->timeout_min;
+    c->timeout_max = d->timeout_max;
+  }
+  if (c->state_interval < 0) {
+    c->state_interval = d->state_interval;
+  }
+  if (c->burst_keepalive < 0) {
+    c->burst_keepalive = d->burst_keepalive;
+  }
+  if (c->cache < 0) {
+    c->cache = d->cache;
+  }
+  if (c->batch_size < 0) {
+    c->batch_size = d->batch_size;
+  }
+  if (c->batch_age < 0) {
+    c->batch_age = d->batch_age;
+  }
+  if (c->sink_buffer < 0) {
+    c->sink_buffer = d->sink_buffer;
+  }
+  if (c->num_deadbands == 0) {
+    memcpy(c->deadband.abs, d->deadband.abs, sizeof(c->deadband.abs));
+    memcpy(c->deadband.pct, d->deadband.pct, sizeof(c->deadband.pct));
+  }
+
+  if (c->alarms == NULL && d->alarms) {
+    if (NULL == (c->alarms = alarm_alloc())) {
+      return -1;
+    }
+    for (i = 0; i < d->alarms->num_rules; i++) {
+      if (0 != alarm_add(c->alarms, d->alarms->rules[i].spec)) {
+	return -1;
+      }
+    }
+  }
+  if ((c->alarm_hook == NULL && d->alarm_hook && NULL == (c->alarm_hook = strdup(d->alarm_hook))) ||
+      (c->alarm_sink == NULL && d->alarm_sink && NULL == (c->alarm_sink = strdup(d->alarm_sink))) ||
+      (c->spill == NULL && d->spill && NULL == (c->spill = strdup(d->spill)))) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Applies the settings of a configuration which belong to the bus side of
+ * a running poller. Only the differences are applied: meters which stay
+ * keep their state.
+ */
+void conf_apply_bus(conf *c, poller *p)
+{
+  p->interval = c->interval;
+  p->discover = c->discover;
+  p->probe_timeout = c->probe_timeout;
+  p->age_out = c->age_out;
+  p->failures_max = c->failures;
+  p->backoff_max = c->max_backoff;
+  tr_set_auto_timeout(p->t, c->timeout_min, c->timeout_max);
+  p->state_interval = c->state_interval;
+  p->burst_keepalive = c->burst_keepalive;
+
+  apply_groups(c, p);
+  apply_meters(c, p);
+  apply_virtuals(c, p);
+}
+
+/**
+ * Applies the cache, deadbands, alarms and sinks of a configuration. Sinks which
+ * stay keep their pending readings. Fails only before anything is changed.
+ */
+int conf_apply_output(conf *c, poller *p)
+{
+  alarms *a = p->alarms;
+
+  if ((c->alarms || c->alarm_hook || c->alarm_sink) && NULL == (a = poller_alarms(p))) {
+    return -1;
+  }
+
+  p->cache = c->cache;
+  p->deadband.heartbeat = c->heartbeat;
+  memcpy(p->deadband.abs, c->deadband.abs, sizeof(p->deadband.abs));
+  memcpy(p->deadband.pct, c->deadband.pct, sizeof(p->deadband.pct));
+
+  if (a) {
+    alarm_take_rules(a, c->alarms, poller_now(p));
+    if (0 != alarm_set_hook(a, c->alarm_hook)) {
+      fprintf(stderr, "Unable to set the alarm hook.\n");
+    }
+    if (0 != alarm_set_sink(a, c->alarm_sink)) {
+      fprintf(stderr, "Unable to create sink `%s'.\n", c->alarm_sink);
+    }
+  }
+
+  apply_sinks(c, p);
+  return 0;
+}
+
+/**
+ * Applies a configuration to a poller which is not running yet. The
+ * poller's settings up to here, from the command line or built in, are
+ * kept as the defaults for keys which are missing from the file, now and
+ * on every reload.
+ */
+int conf_apply(conf *c, poller *p)
+{
+  if (NULL == (p->defaults = current_settings(p)) || 0 != merge(c, p->defaults) ||
+      0 != conf_apply_output(c, p)) {
+    return -1;
+  }
+  conf_apply_bus(c, p);
+  if (p->state == NULL) {
+    p->state = c->state;
+  }
+  if (p->control == NULL) {
+    p->control = c->control;
+  }
+  if (p->burst_dir == NULL) {
+    p->burst_dir = c->burst_dir;
+  }
+  return 0;
+}
+
+/**
+ * Reads the poller's configuration file again. Called by the publisher,
+ * which applies the output settings itself and hands the rest to the bus
+ * loop.
+ */
+int conf_reload(poller *p)
+{
+  conf *c;
+
+  if (NULL == (c = conf_load(p->config))) {
+    return -1;
+  }
+  if (c->device && p->device && 0 != strcmp(c->device, p->device)) {
+    fprintf(stderr, "Changing the device requires a restart.\n");
+  }
+  if (c->state && p->state && 0 != strcmp(c->state, p->state)) {
+    fprintf(stderr, "Changing the state file requires a restart.\n");
+  }
+  if (0 != merge(c, p->defaults) || 0 != conf_apply_output(c, p)) {
+    conf_free(c);
+    return -1;
+  }
+  poller_reconfigure(p, c);
+  return 0;
+}
+
+/**
+ * Returns an inotify descriptor which becomes readable when the file is
+ * written or replaced, or -1.
+ */
+int conf_watch(const char *file)
+{
+  char *copy = strdup(file);
+  int fd;
+
+  if (copy == NULL) {
+    return -1;
+  }
+  /* Watch the directory, editors often replace the file */
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd >= 0 && inotify_add_watch(fd, dirname(copy), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  free(copy);
+  return fd;
+}
+
+/**
+ * Consumes the pending events of a watch and returns true if the file
+ * changed.
+ */
+int conf_changed(int fd, const char *file)
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  char *copy;
+  char *name;
+  int changed = 0;
+  int len;
+
+  if (fd < 0 || NULL == (copy = strdup(file))) {
+    return 0;
+  }
+  name = basename(copy);
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    char *e = buf;
+    while (e < buf + len) {
+      struct inotify_event *event = (struct inotify_event *) e;
+      if (event->len > 0 && 0 == strcmp(event->name, name)) {
+	changed = 1;
+      }
+      e += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  free(copy);
+  return changed;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __CONF_H
+#define __CONF_H
+
+#include "poller.h"
+
+/*
+ * Contents of a configuration file, with the deadbands and alarm rules
+ * compiled. Settings which do not appear in the file are -1 or NULL until
+ * conf_apply() or conf_reload() fill them in from the poller's defaults.
+ */
+struct conf
+{
+  char *device;
+
+  long long interval;
+  long long heartbeat;
+  int discover;
+  int probe_timeout;
+  long long age_out;
+  int failures;
+  long long max_backoff;
+  int timeout_min;
+  int timeout_max;
+  int baud;
+  char *state;
+  long long state_interval;
+  char *control;
+  char *burst_dir;
+  long long burst_keepalive;
+  int cache;
+
+  int num_meters;
+  struct {
+    int address;
+    long long interval;
+    double ct;
+    double pt;
+    int fast;
+  } meters[256];
+
+  int num_groups;
+  struct {
+    char *spec;
+    long long interval;
+  } groups[POLLER_GROUPS];
+
+  int num_virtuals;
+  char *virtuals[POLLER_VIRTUALS];
+
+  int num_deadbands;
+  deadband deadband;
+
+  /* NULL if there are no rules */
+  alarms *alarms;
+  char *alarm_hook;
+  char *alarm_sink;
+
+  int num_sinks;
+  char *sinks[16];
+  int batch_size;
+  long long batch_age;
+  int sink_buffer;
+  char *spill;
+};
+
+typedef struct conf conf;
+
+conf *conf_load(const char *file);
+void conf_free(conf *c);
+int conf_apply(conf *c, poller *p);
+void conf_apply_bus(conf *c, poller *p);
+int conf_apply_output(conf *c, poller *p);
+int conf_reload(poller *p);
+int conf_watch(const char *file);
+int conf_changed(int fd, const char *file);
+double conf_parse_ratio(const char *s);
+int conf_parse_range(const char *s, int *min, int *max);
+long long conf_parse_ms(const char *s);
+
+#endif /* __CONF_H */
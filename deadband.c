@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "deadband.h"
+
+void deadband_init(deadband *d)
+{
+  memset(d, 0, sizeof(deadband));
+}
+
+/**
+ * Sets a threshold from a specification of the form "field=value" for an
+ * absolute or "field=value%" for a relative deadband. The field may also
+ * be "voltage" or "current" for all phases, or "all".
+ */
+int deadband_set(deadband *d, const char *spec)
+{
+  char name[32];
+  const char *eq;
+  char *end;
+  double value;
+  int pct = 0;
+  int field = -1;
+  int i;
+
+  if (NULL == (eq = strchr(spec, '=')) || eq - spec >= sizeof(name)) {
+    return -1;
+  }
+  memcpy(name, spec, eq - spec);
+  name[eq - spec] = '\0';
+
+  value = strtod(eq + 1, &end);
+  if (end == eq + 1 || value < 0) {
+    return -1;
+  }
+  if (*end == '%') {
+    pct = 1;
+    end++;
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+
+  for (i = 0; i < TR_FIELDS; i++) {
+    const char *f = tr_field_name(i);
+
+    if (0 == strcmp(name, "all") ||
+	0 == strcmp(name, f) ||
+	(0 == strcmp(name, "voltage") && 0 == strncmp(f, "voltage", 7)) ||
+	(0 == strcmp(name, "current") && 0 == strncmp(f, "current", 7))) {
+      if (pct) {
+	d->pct[i] = value;
+      } else {
+	d->abs[i] = llround(value * tr_field_unit(i));
+      }
+      field = i;
+    }
+  }
+
+  return (field >= 0) ? 0 : -1;
+}
+
+/**
+ * Decides whether a freshly read value has to be reported. Returns true
+ * and remembers the value if it left the deadband around the last
+ * reported value, or if the heartbeat interval has expired.
+ */
+int deadband_check(deadband *d, int n, int field, long long value, long long now)
+{
+  long long threshold;
+  long long delta;
+
+  if (d->last[n][field].valid) {
+    delta = llabs(value - d->last[n][field].value);
+    threshold = llabs(d->last[n][field].value) * d->pct[field] / 100.0;
+    if (threshold < d->abs[field]) {
+      threshold = d->abs[field];
+    }
+
+    if ((threshold > 0 ? delta <= threshold : delta == 0) &&
+	(d->heartbeat == 0 || now - d->last[n][field].reported < d->heartbeat)) {
+      return 0;
+    }
+  }
+
+  d->last[n][field].valid = 1;
+  d->last[n][field].value = value;
+  d->last[n][field].reported = now;
+  return 1;
+}
+
+/**
+ * Forgets the reported values of a transducer, so that the next reading
+ * is reported in full.
+ */
+void deadband_forget(deadband *d, int n)
+{
+  memset(d->last[n], 0, sizeof(d->last[n]));
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __DEADBAND_H
+#define __DEADBAND_H
+
+#include "transducer.h"
+
+struct deadband
+{
+  /* Thresholds per field, absolute in the field's integer units. A
+     change is reported if it exceeds the larger of both thresholds. */
+  long long abs[TR_FIELDS];
+  double pct[TR_FIELDS];
+
+  /* Maximum time (ms) a field may stay unreported, 0 = forever. */
+  long long heartbeat;
+
+  struct {
+    int valid;
+    long long value;
+    long long reported;
+  } last[256][TR_FIELDS];
+};
+
+typedef struct deadband deadband;
+
+void deadband_init(deadband *d);
+int deadband_set(deadband *d, const char *spec);
+int deadband_check(deadband *d, int n, int field, long long value, long long now);
+void deadband_forget(deadband *d, int n);
+
+#endif /* __DEADBAND_H */
@@ -0,0 +1,658 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ *
+ * Bulk decoder for archived transducer replies.
+ *
+ * Reads a file of raw reply lines of the read-all (A) and energy (W)
+ * commands, optionally prefixed with a timestamp and an address:
+ *
+ *   1792400646 1 !+0.7672+0.4010+0.3076+0.0100+0.9800050.01
+ *   !150000064000003A1F
+ *
+ * and writes the decoded values into a directory of column files, one
+ * file of little endian integers per column. The input is memory mapped
+ * and decoded by several threads, each one working on its own chunk of
+ * lines. A first pass counts the frames of every chunk, so that the
+ * second pass can write every row directly to its final place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "transducer.h"
+#include "timer.h"
+
+#define A_LEN_1PHASE 42
+#define A_LEN_3PHASE 70
+#define W_LEN 19
+
+/* Columns of the A table */
+#define A_TIMESTAMP 0
+#define A_ADDRESS 1
+#define A_PHASES 2
+#define A_VALID 3
+#define A_VALUES 4
+#define A_COLUMNS (A_VALUES + TR_KWHR)
+
+/* Columns of the W table */
+#define W_TIMESTAMP 0
+#define W_ADDRESS 1
+#define W_VALID 2
+#define W_PERIOD 3
+#define W_KWHR 4
+#define W_KVARHR 5
+#define W_COLUMNS 6
+
+#define THREADS_MAX 256
+
+static char *progname;
+
+static const char *w_names[W_COLUMNS] = {
+  "timestamp", "address", "valid", "time_period", "kwhr", "kvarhr"
+};
+
+/*
+ * Full scale values for the optional conversion into engineering units,
+ * as in the library. All 0 if the values are left as fractions.
+ */
+static long long scale_volts;
+static long long scale_amps;
+static long long scale_power;
+
+struct column
+{
+  int fd;
+  int width;
+  unsigned char *data;
+};
+
+struct chunk
+{
+  const char *start;
+  const char *end;
+
+  /* Rows of this chunk, and of all chunks before it */
+  long a_rows;
+  long w_rows;
+  long a_first;
+  long w_first;
+
+  long invalid;
+  pthread_t thread;
+};
+
+/* End of the input, word loads must not go beyond it */
+static const char *input_end;
+
+static struct column a_columns[A_COLUMNS];
+static struct column w_columns[W_COLUMNS];
+
+/* Repeats a byte into all bytes of a word */
+#define ONES 0x0101010101010101ULL
+#define BYTES(b) ((b) * ONES)
+
+/**
+ * Loads 8 characters into a word, the first one into the lowest byte,
+ * which is what the SWAR functions below expect on any byte order.
+ */
+static inline uint64_t load8(const char *p)
+{
+  uint64_t x;
+
+  memcpy(&x, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap64(x);
+#elif __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Unsupported byte order"
+#endif
+  return x;
+}
+
+/**
+ * Returns the bytes of x (a mask of 0x80 per byte) which are ASCII
+ * digits. Assumes that all bytes are below 0x80.
+ */
+static inline uint64_t swar_digits(uint64_t x)
+{
+  uint64_t ge0 = x + BYTES(0x80 - '0');
+  uint64_t le9 = ~(x + BYTES(0x80 - '9' - 1));
+
+  return ge0 & le9 & BYTES(0x80);
+}
+
+/**
+ * Like swar_digits(), for hexadecimal digits in either case.
+ */
+static inline uint64_t swar_hexdigits(uint64_t x)
+{
+  uint64_t l = x | BYTES(0x20);
+  uint64_t gea = l + BYTES(0x80 - 'a');
+  uint64_t lef = ~(l + BYTES(0x80 - 'f' - 1));
+
+  return swar_digits(x) | (gea & lef & BYTES(0x80));
+}
+
+/**
+ * Decodes a 7 character decimal field "+D.DDDD" into millionths, the
+ * same as the library's parse_fixed(). Returns -1 if the field does not
+ * have this format.
+ */
+static inline int parse_field(const char *p, long long *value)
+{
+  /* Positions of the digits within the first 7 bytes */
+  const uint64_t digits = 0x80808080008000ULL;
+  uint64_t x = load8(p);
+  uint64_t frac;
+  long long v;
+
+  if ((x & 0x0080808080808080ULL) || (swar_digits(x) & digits) != digits || p[2] != '.' ||
+      (p[0] != '+' && p[0] != '-')) {
+    return -1;
+  }
+
+  /* The four fraction digits, d3 d4 d5 d6, most significant first */
+  frac = (x >> 24) & 0xffffffff;
+  frac -= 0x30303030;
+  frac = (frac * 10 + (frac >> 8)) & 0x00ff00ff;
+  frac = (frac * 100 + (frac >> 16)) & 0xffff;
+
+  v = ((p[1] - '0') * 10000LL + frac) * 100;
+  *value = (p[0] == '-') ? -v : v;
+  return 0;
+}
+
+/**
+ * Decodes the 6 character frequency field "DDD.DD" into mHz.
+ */
+static inline int parse_frequency(const char *p, long long *value)
+{
+  const uint64_t digits = 0x808000808080ULL;
+  uint64_t x = load8(p);
+
+  if ((x & 0x0000808080808080ULL) || (swar_digits(x) & digits) != digits || p[3] != '.') {
+    return -1;
+  }
+  *value = ((p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0')) * 1000LL +
+    (p[4] - '0') * 100 + (p[5] - '0') * 10;
+  return 0;
+}
+
+/**
+ * Decodes 8 hexadecimal digits, most significant first.
+ */
+static inline uint32_t parse_hex8(uint64_t x)
+{
+  uint64_t nibbles = (x & BYTES(0x0f)) + ((x & BYTES(0x40)) >> 6) * 9;
+
+  x = ((nibbles << 4) + (nibbles >> 8)) & 0x00ff00ff00ff00ffULL;
+  x = ((x << 8) + (x >> 16)) & 0x0000ffff0000ffffULL;
+  x = (x << 16) + (x >> 32);
+  return (uint32_t) x;
+}
+
+/**
+ * Sums the bytes of a word.
+ */
+static inline unsigned swar_sum(uint64_t x)
+{
+  x = (x & 0x00ff00ff00ff00ffULL) + ((x >> 8) & 0x00ff00ff00ff00ffULL);
+  return (x * 0x0001000100010001ULL) >> 48;
+}
+
+/**
+ * Decodes an energy reply: time period, both totalizers and the
+ * checksum over the first 17 bytes.
+ */
+static int parse_energy(const char *p, long long *period, long long *kwhr, long long *kvarhr)
+{
+  /* Bytes 2-9 (the second digit of the period and the kWh counter),
+     9-16 (the kvarh counter) and 11-18 (ending with the checksum) */
+  uint64_t a = load8(p + 2);
+  uint64_t b = load8(p + 9);
+  uint64_t c = load8(p + 11);
+  unsigned sum;
+
+  if (p[0] != '!' || ((a | b | c) & BYTES(0x80)) ||
+      (swar_hexdigits(a) & swar_hexdigits(b) & swar_hexdigits(c)) != BYTES(0x80) ||
+      p[1] < '0' || p[1] > '9' || p[2] < '0' || p[2] > '9') {
+    return -1;
+  }
+
+  sum = swar_sum(load8(p)) + swar_sum(load8(p + 8)) + (unsigned char) p[16];
+  if ((sum & 0xff) != (parse_hex8(c) & 0xff)) {
+    return -1;
+  }
+
+  *period = (p[1] - '0') * 10 + (p[2] - '0');
+  *kwhr = parse_hex8(a) & 0x0fffffff;
+  *kvarhr = parse_hex8(b) & 0x0fffffff;
+  return 0;
+}
+
+static inline long long scale(long long fraction, long long full)
+{
+  return full ? fraction * full / TR_FRACTION : fraction;
+}
+
+static inline void put(struct column *c, long row, long long value)
+{
+  unsigned char *d = c->data + row * c->width;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  switch (c->width) {
+  case 8: {
+    int64_t v = value;
+    memcpy(d, &v, 8);
+    return;
+  }
+  case 2: {
+    int16_t v = value;
+    memcpy(d, &v, 2);
+    return;
+  }
+  }
+#endif
+  int i;
+
+  for (i = 0; i < c->width; i++) {
+    d[i] = value >> (8 * i);
+  }
+}
+
+/**
+ * Splits a line into the optional prefix and the frame. Returns the
+ * frame length, and leaves the frame in *frame.
+ */
+static int split(const char *line, const char *end, const char **frame,
+		 long long *timestamp, int *address)
+{
+  const char *bang = memchr(line, '!', end - line);
+
+  *timestamp = 0;
+  *address = -1;
+  if (bang == NULL) {
+    return -1;
+  }
+  if (bang > line) {
+    char *e;
+
+    *timestamp = strtoll(line, &e, 10);
+    *address = strtol(e, &e, 10);
+  }
+  *frame = bang;
+  while (end > bang && (end[-1] == '\r' || end[-1] == ' ')) {
+    end--;
+  }
+  return end - bang;
+}
+
+static void decode_a(struct chunk *c, long row, const char *frame, int len,
+		     long long timestamp, int address)
+{
+  /* Offsets of the fields in both layouts */
+  static const int one[] = { TR_VOLTAGE1, TR_CURRENT1, TR_POWER, TR_VARS, TR_PFACTOR };
+  static const int three[] = { TR_VOLTAGE1, TR_CURRENT1, TR_VOLTAGE2, TR_CURRENT2,
+			       TR_VOLTAGE3, TR_CURRENT3, TR_POWER, TR_VARS, TR_PFACTOR };
+  const int *fields = (len == A_LEN_1PHASE) ? one : three;
+  int num = (len == A_LEN_1PHASE) ? 5 : 9;
+  long long v[TR_KWHR];
+  int valid = 1;
+  int i;
+
+  memset(v, 0, sizeof(v));
+  for (i = 0; i < num; i++) {
+    long long x = 0;
+
+    if (0 != parse_field(frame + 1 + 7 * i, &x)) {
+      valid = 0;
+    }
+    v[fields[i]] = x;
+  }
+  if (0 != parse_frequency(frame + 1 + 7 * num, &v[TR_FREQUENCY])) {
+    valid = 0;
+  }
+  if (!valid) {
+    c->invalid++;
+    memset(v, 0, sizeof(v));
+  }
+
+  v[TR_VOLTAGE1] = scale(v[TR_VOLTAGE1], scale_volts);
+  v[TR_VOLTAGE2] = scale(v[TR_VOLTAGE2], scale_volts);
+  v[TR_VOLTAGE3] = scale(v[TR_VOLTAGE3], scale_volts);
+  v[TR_CURRENT1] = scale(v[TR_CURRENT1], scale_amps);
+  v[TR_CURRENT2] = scale(v[TR_CURRENT2], scale_amps);
+  v[TR_CURRENT3] = scale(v[TR_CURRENT3], scale_amps);
+  v[TR_POWER] = scale(v[TR_POWER], scale_power);
+  v[TR_VARS] = scale(v[TR_VARS], scale_power);
+
+  put(&a_columns[A_TIMESTAMP], row, timestamp);
+  put(&a_columns[A_ADDRESS], row, address);
+  put(&a_columns[A_PHASES], row, (len == A_LEN_1PHASE) ? 1 : 3);
+  put(&a_columns[A_VALID], row, valid);
+  for (i = 0; i < TR_KWHR; i++) {
+    put(&a_columns[A_VALUES + i], row, v[i]);
+  }
+}
+
+static void decode_w(struct chunk *c, long row, const char *frame,
+		     long long timestamp, int address)
+{
+  long long period = 0, kwhr = 0, kvarhr = 0;
+  int valid = 1;
+
+  if (0 != parse_energy(frame, &period, &kwhr, &kvarhr)) {
+    c->invalid++;
+    valid = 0;
+    period = kwhr = kvarhr = 0;
+  }
+  if (scale_power) {
+    /* The totalizers count full scale power seconds, divided first so
+       that the product stays in range */
+    kwhr = kwhr / 3600 * scale_power + kwhr % 3600 * scale_power / 3600;
+    kvarhr = kvarhr / 3600 * scale_power + kvarhr % 3600 * scale_power / 3600;
+  }
+
+  put(&w_columns[W_TIMESTAMP], row, timestamp);
+  put(&w_columns[W_ADDRESS], row, address);
+  put(&w_columns[W_VALID], row, valid);
+  put(&w_columns[W_PERIOD], row, period);
+  put(&w_columns[W_KWHR], row, kwhr);
+  put(&w_columns[W_KVARHR], row, kvarhr);
+}
+
+/**
+ * Walks through the lines of a chunk. Only counts the frames if decode
+ * is false.
+ */
+static void walk(struct chunk *c, int decode)
+{
+  char last[A_LEN_3PHASE + 8];
+  const char *line = c->start;
+  long a = c->a_first;
+  long w = c->w_first;
+
+  while (line < c->end) {
+    const char *end = memchr(line, '\n', c->end - line);
+    const char *frame;
+    long long timestamp;
+    int address;
+    int len;
+
+    if (end == NULL) {
+      end = c->end;
+    }
+    len = split(line, end, &frame, &timestamp, &address);
+
+    /* The word loads read up to two bytes past the end of a frame. At
+       the end of the input, decode from a padded copy. */
+    if (decode && len > 0 && len <= A_LEN_3PHASE && frame + len + 8 > input_end) {
+      memset(last, 0, sizeof(last));
+      memcpy(last, frame, len);
+      frame = last;
+    }
+
+    if (len == A_LEN_1PHASE || len == A_LEN_3PHASE) {
+      if (decode) {
+	decode_a(c, a, frame, len, timestamp, address);
+      }
+      a++;
+    } else if (len == W_LEN) {
+      if (decode) {
+	decode_w(c, w, frame, timestamp, address);
+      }
+      w++;
+    } else if (!decode && len != 0 && end > line) {
+      c->invalid++;
+    }
+    line = end + 1;
+  }
+
+  if (!decode) {
+    c->a_rows = a - c->a_first;
+    c->w_rows = w - c->w_first;
+  }
+}
+
+static void *count_chunk(void *arg)
+{
+  walk(arg, 0);
+  return NULL;
+}
+
+static void *decode_chunk(void *arg)
+{
+  walk(arg, 1);
+  return NULL;
+}
+
+/**
+ * Creates a column file for rows rows and maps it.
+ */
+static int column_open(struct column *c, const char *dir, const char *table,
+		       const char *name, int width, long rows)
+{
+  char file[4096];
+
+  snprintf(file, sizeof(file), "%s/%s.%s", dir, table, name);
+  c->width = width;
+  c->data = NULL;
+  if (0 > (c->fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644))) {
+    return -1;
+  }
+  if (rows == 0) {
+    return 0;
+  }
+  if (0 != ftruncate(c->fd, rows * width)) {
+    return -1;
+  }
+  c->data = mmap(NULL, rows * width, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+  return (c->data == MAP_FAILED) ? -1 : 0;
+}
+
+static void column_close(struct column *c, long rows)
+{
+  if (c->data && c->data != MAP_FAILED) {
+    munmap(c->data, rows * c->width);
+  }
+  if (c->fd >= 0) {
+    close(c->fd);
+  }
+}
+
+/**
+ * Runs fn on all chunks in parallel.
+ */
+static void run(struct chunk *chunks, int n, void *(*fn)(void *))
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (0 != pthread_create(&chunks[i].thread, NULL, fn, &chunks[i])) {
+      fn(&chunks[i]);
+      chunks[i].thread = 0;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (chunks[i].thread) {
+      pthread_join(chunks[i].thread, NULL);
+    }
+  }
+}
+
+static void usage()
+{
+  fprintf(stderr, "%s [-j threads] [--volts V --amps A [--ct ratio] [--pt ratio]] input outdir\n",
+	  progname);
+  fprintf(stderr, "    Decode a file of raw A and W replies into column files.\n");
+  exit(EXIT_FAILURE);
+}
+
+static struct option long_options[] = {
+  { "help",    0, NULL, 'h' },
+  { "threads", 1, NULL, 'j' },
+  { "volts",   1, NULL, 'U' },
+  { "amps",    1, NULL, 'I' },
+  { "ct",      1, NULL, 'c' },
+  { "pt",      1, NULL, 'p' },
+  { NULL,      0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+  struct chunk chunks[THREADS_MAX];
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  double volts = 0, amps = 0, ct = 1, pt = 1;
+  long a_rows = 0, w_rows = 0, invalid = 0;
+  long long start;
+  const char *input, *dir;
+  struct stat st;
+  char *data;
+  int fd;
+  int optc;
+  int i;
+
+  progname = argv[0];
+
+  while ((optc = getopt_long(argc, argv, "hj:", long_options, (int *) 0)) != EOF) {
+    switch (optc) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'U':
+      volts = atof(optarg);
+      break;
+    case 'I':
+      amps = atof(optarg);
+      break;
+    case 'c':
+      ct = atof(optarg);
+      break;
+    case 'p':
+      pt = atof(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind != 2 || (volts > 0) != (amps > 0) || ct <= 0 || pt <= 0 ||
+      volts * pt * amps * ct * 1000 > TR_SCALE_MAX) {
+    usage();
+  }
+  input = argv[optind];
+  dir = argv[optind + 1];
+  if (threads < 1) {
+    threads = 1;
+  } else if (threads > THREADS_MAX) {
+    threads = THREADS_MAX;
+  }
+  if (volts > 0) {
+    scale_volts = llround(volts * pt * 1000);
+    scale_amps = llround(amps * ct * 1000);
+    scale_power = llround(volts * pt * amps * ct * 1000);
+  }
+
+  if (0 > (fd = open(input, O_RDONLY)) || 0 != fstat(fd, &st)) {
+    fprintf(stderr, "Unable to open `%s'.\n", input);
+    exit(EXIT_FAILURE);
+  }
+  if (0 != mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Unable to create `%s'.\n", dir);
+    exit(EXIT_FAILURE);
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (st.st_size == 0 || data == MAP_FAILED) {
+    fprintf(stderr, "Unable to read `%s'.\n", input);
+    exit(EXIT_FAILURE);
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  input_end = data + st.st_size;
+  start = timer_now_ns();
+
+  /* Chunks end at line boundaries */
+  if (st.st_size < threads * 4096LL) {
+    threads = 1;
+  }
+  for (i = 0; i < threads; i++) {
+    const char *end = data + st.st_size;
+
+    chunks[i].start = (i == 0) ? data : chunks[i - 1].end;
+    if (i < threads - 1) {
+      const char *nl;
+
+      end = data + st.st_size / threads * (i + 1);
+      if (end < chunks[i].start) {
+	end = chunks[i].start;
+      }
+      nl = memchr(end, '\n', data + st.st_size - end);
+      end = nl ? nl + 1 : data + st.st_size;
+    }
+    chunks[i].end = end;
+    chunks[i].a_first = 0;
+    chunks[i].w_first = 0;
+    chunks[i].invalid = 0;
+  }
+
+  /* Pass 1: count */
+  run(chunks, threads, count_chunk);
+  for (i = 0; i < threads; i++) {
+    chunks[i].a_first = a_rows;
+    chunks[i].w_first = w_rows;
+    a_rows += chunks[i].a_rows;
+    w_rows += chunks[i].w_rows;
+    invalid += chunks[i].invalid;
+    chunks[i].invalid = 0;
+  }
+
+  if (0 != column_open(&a_columns[A_TIMESTAMP], dir, "a", "timestamp", 8, a_rows) ||
+      0 != column_open(&a_columns[A_ADDRESS], dir, "a", "address", 2, a_rows) ||
+      0 != column_open(&a_columns[A_PHASES], dir, "a", "phases", 1, a_rows) ||
+      0 != column_open(&a_columns[A_VALID], dir, "a", "valid", 1, a_rows)) {
+    fprintf(stderr, "Unable to create output files in `%s'.\n", dir);
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < TR_KWHR; i++) {
+    if (0 != column_open(&a_columns[A_VALUES + i], dir, "a", tr_field_name(i), 8, a_rows)) {
+      fprintf(stderr, "Unable to create output files in `%s'.\n", dir);
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < W_COLUMNS; i++) {
+    int width = (i == W_ADDRESS) ? 2 : (i == W_VALID) ? 1 : 8;
+
+    if (0 != column_open(&w_columns[i], dir, "w", w_names[i], width, w_rows)) {
+      fprintf(stderr, "Unable to create output files in `%s'.\n", dir);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Pass 2: decode straight into the columns */
+  run(chunks, threads, decode_chunk);
+  for (i = 0; i < threads; i++) {
+    invalid += chunks[i].invalid;
+  }
+
+  for (i = 0; i < A_COLUMNS; i++) {
+    column_close(&a_columns[i], a_rows);
+  }
+  for (i = 0; i < W_COLUMNS; i++) {
+    column_close(&w_columns[i], w_rows);
+  }
+
+  fprintf(stderr, "%ld A and %ld W frames, %ld invalid, %.0f MB/s with %d threads.\n",
+	  a_rows, w_rows, invalid,
+	  st.st_size / 1e6 / ((timer_now_ns() - start) / 1e9), threads);
+
+  munmap(data, st.st_size);
+  close(fd);
+  exit(EXIT_SUCCESS);
+}
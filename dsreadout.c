@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #include <sys/time.h>
 #include <sys/select.h>
@@ -18,10 +19,20 @@
 #include "serial.h"
 #include "string.h"
 #include "transducer.h"
+#include "poller.h"
+#include "publisher.h"
+#include "conf.h"
+#include "cache.h"
+#include "plan.h"
+#include "state.h"
+#include "timer.h"
 
 char *version = "version 0.2";
 char *progname;
 
+/* The poller, so that signal handlers can stop it */
+static poller *the_poller = NULL;
+
 static struct option long_options[] = {
   { "verbose",     0, NULL, 'V' },
   { "help",        0, NULL, 'h' },
@@ -34,6 +45,48 @@ static struct option long_options[] = {
   { "scan",        0, NULL, 'S' },
   { "reset",       0, NULL, 'R' },
   { "force",       0, NULL, 'f' },
+  { "poll",        0, NULL, 'P' },
+  { "meter",       1, NULL, 'm' },
+  { "fast",        1, NULL, 'Q' },
+  { "group",       1, NULL, 'G' },
+  { "virtual",     1, NULL, 'U' },
+  { "footprint",   0, NULL, 'O' },
+  { "plan",        0, NULL, 'p' },
+  { "calibrate",   1, NULL, 'I' },
+  { "auto-timeout", 1, NULL, 'e' },
+  { "baud",        1, NULL, 'g' },
+  { "state",       1, NULL, 'Z' },
+  { "state-interval", 1, NULL, 'z' },
+  { "burst",       1, NULL, 'x' },
+  { "burst-dir",   1, NULL, 'y' },
+  { "burst-keepalive", 1, NULL, 'w' },
+  { "control",     1, NULL, 'N' },
+  { "max-age",     1, NULL, 'E' },
+  { "cache",       0, NULL, 'q' },
+  { "interval",    1, NULL, 'n' },
+  { "deadband",    1, NULL, 'D' },
+  { "heartbeat",   1, NULL, 'H' },
+  { "discover",    0, NULL, 'X' },
+  { "probe-timeout", 1, NULL, 'T' },
+  { "age-out",     1, NULL, 'A' },
+  { "failures",    1, NULL, 'K' },
+  { "max-backoff", 1, NULL, 'M' },
+  { "capture",     1, NULL, 'C' },
+  { "replay",      1, NULL, 'Y' },
+  { "replay-speed", 1, NULL, 's' },
+  { "config",      1, NULL, 'F' },
+  { "ratio",       1, NULL, 'o' },
+  { "sink",        1, NULL, 'k' },
+  { "batch-size",  1, NULL, 'b' },
+  { "batch-age",   1, NULL, 'B' },
+  { "sink-buffer", 1, NULL, 'u' },
+  { "spill",       1, NULL, 'L' },
+  { "lock-wait",   1, NULL, 'W' },
+  { "trace",       1, NULL, 't' },
+  { "alarm",       1, NULL, 'l' },
+  { "alarm-hook",  1, NULL, 'j' },
+  { "alarm-sink",  1, NULL, 'J' },
+  { NULL,          0, NULL, 0 }
 };
 
 /**
@@ -48,8 +101,9 @@ void help()
   printf("    Show version.\n");
   printf("%s [-d|--device device] [-i|--identify address]\n", progname);
   printf("    Identify transducer.\n");
-  printf("%s [-d|--device device] [-r|--read address]\n", progname);
-  printf("    Show current values.\n");
+  printf("%s [-d|--device device] [-r|--read address] [--max-age seconds[s|ms]]\n", progname);
+  printf("    Show current values, or a reading shared with other processes which is at\n");
+  printf("    most max-age old.\n");
   printf("%s [-d|--device device] [-r|--clear address]\n", progname);
   printf("    Clear energy totalizer.\n");
   printf("%s [-d|--device device] [--scan]\n", progname);
@@ -58,6 +112,50 @@ void help()
   printf("    Reset the transducer and set the transducer address. USE WITH CARE!\n");
   printf("%s [-d|--device device] [--reset]\n", progname);
   printf("    Reset the transducer to its factory defaults. USE WITH CARE!\n");
+  printf("%s [-d|--device device] --poll --meter address [--meter address ...]\n", progname);
+  printf("    [--fast address ...] [--group name=address,address,... ...]\n");
+  printf("    [--virtual name=address+address-address... ...]\n");
+  printf("    [--interval seconds] [--deadband field=value[%%] ...] [--heartbeat seconds]\n");
+  printf("    [--discover [--probe-timeout ms] [--age-out seconds]]\n");
+  printf("    [--failures count] [--max-backoff seconds]\n");
+  printf("    [--sink file:path|fifo:path|udp:host:port|unix:path ...]\n");
+  printf("    [--batch-size readings] [--batch-age ms] [--sink-buffer bytes] [--spill dir]\n");
+  printf("    [--alarm rule ...] [--alarm-hook command] [--alarm-sink sink]\n");
+  printf("    Poll transducers continuously and print changed values.\n");
+  printf("%s [--config file] options\n", progname);
+  printf("    Read settings from a configuration file. A running poller reloads it\n");
+  printf("    when it changes or on SIGHUP.\n");
+  printf("%s [--ratio address:ct[:pt] ...] options\n", progname);
+  printf("    Scale the values of a transducer with external transformers.\n");
+  printf("%s [-d|--device device] --capture file options\n", progname);
+  printf("    Record all bus traffic into a capture file.\n");
+  printf("%s --replay file [--replay-speed original|max] options\n", progname);
+  printf("    Use the traffic recorded in a capture file instead of a device.\n");
+  printf("%s [-d|--device device] --trace file options\n", progname);
+  printf("    Record a timeline of all bus transactions (Chrome trace format).\n");
+  printf("%s [--baud rate] [--auto-timeout min-max] options\n", progname);
+  printf("    Set the baud rate, and derive the reply timeout of every address from its\n");
+  printf("    observed latency, within min and max ms.\n");
+  printf("%s --poll --state file [--state-interval seconds] options\n", progname);
+  printf("    Save the state of the poller periodically and on exit, and start from\n");
+  printf("    the saved state.\n");
+  printf("%s [-d|--device device] --burst address:seconds [--burst-dir dir] [--poll\n", progname);
+  printf("    [--burst-keepalive seconds] options]\n");
+  printf("    Read one transducer as often as the bus allows and record its values in\n");
+  printf("    a file of its own. While polling, the others are only kept alive.\n");
+  printf("%s --poll --cache options\n", progname);
+  printf("    Share the readings with --read --max-age.\n");
+  printf("%s --poll --control fifo options\n", progname);
+  printf("    Accept commands (\"burst address seconds\") through a FIFO.\n");
+  printf("%s [--lock-wait ms] options\n", progname);
+  printf("    Wait this long for the bus while another process uses it.\n");
+  printf("%s --footprint options\n", progname);
+  printf("    Show the memory the poller allocates at startup with these options\n");
+  printf("    (reloads and burst files allocate more, see the README).\n");
+  printf("%s --plan [--calibrate rounds] [--state file] options\n", progname);
+  printf("    Show the bus utilisation and staleness of the meters to poll, and how\n");
+  printf("    many meters the bus can take. --calibrate times the transducers on the\n");
+  printf("    bus instead of estimating.\n");
 }
 
 /**
@@ -80,57 +178,113 @@ void warnforce()
   exit(EXIT_FAILURE);
 }
 
+/**
+ * Stops the poller when the program is terminated.
+ */
+void stop_poller(int sig)
+{
+  if (the_poller) {
+    the_poller->stop = 1;
+  }
+}
+
+/**
+ * Reloads the configuration file on SIGHUP.
+ */
+void reload_poller(int sig)
+{
+  if (the_poller) {
+    the_poller->reload = 1;
+  }
+}
+
+/**
+ * Reports a failed transaction, which may also have failed because other
+ * processes kept the bus busy.
+ */
+void print_error(int result, char *message)
+{
+  if (result == TR_LOCK) {
+    fprintf(stderr, "The bus is busy.\n");
+  } else {
+    fprintf(stderr, "%s\n", message);
+  }
+}
+
 /**
  * Identify transducer model.
  */
 int action_identify(transducer *t, char *device, int address)
 {
   int success = EXIT_FAILURE;
+  int result;
 
-  if (TR_OK == tr_identify(t, address)) {
+  if (TR_OK == (result = tr_identify(t, address))) {
     printf("max_voltage: %d\n", t->transducers[address].max_volts);
     printf("max_current: %d\n", t->transducers[address].max_amps);
     success = EXIT_SUCCESS;
   } else {
-    fprintf(stderr, "Unknown transducer model.\n");
+    print_error(result, "Unknown transducer model.");
   }
 
   return success;
 }
 
+void print_value(transducer *t, int address, char *name, int field)
+{
+  char text[32];
+
+  tr_format(text, sizeof(text), field, tr_value(t, address, field));
+  printf("%s: %s\n", name, text);
+}
+
 /**
  * Read transducer data.
  */
-int action_read(transducer *t, char *device, int address)
+int action_read(transducer *t, char *device, int address, long long max_age)
 {
   int success = EXIT_FAILURE;
+  long long stamp;
+  int result;
 
-  if (TR_OK == tr_identify(t, address)) {
-    if (TR_OK == tr_read(t, address) && TR_OK == tr_read_energy(t, address)) {
+  if (max_age >= 0) {
+    /* Shared with other processes reading the same transducer */
+    result = cache_read(t, device, address, max_age, &stamp);
+    if (result == TR_OK && t->verbose > 0) {
+      printf("Reading is %lld ms old.\n", (timer_wall_ns() - stamp) / 1000000);
+    }
+  } else if (TR_OK == (result = tr_identify(t, address))) {
+    if (TR_OK == (result = tr_read(t, address))) {
+      result = tr_read_energy(t, address);
+    }
+  }
+
+  if (result != TR_UNKNOWN_MODEL) {
+    if (result == TR_OK) {
       printf("max_voltage: %d\n", t->transducers[address].max_volts);
       printf("max_current: %d\n", t->transducers[address].max_amps);
       if (t->transducers[address].type == TR_1PHASE) {
-	printf("voltage: %f\n", t->transducers[address].voltage_f1 * t->transducers[address].max_volts);
-	printf("current: %f\n", t->transducers[address].current_f1 * t->transducers[address].max_amps);
+	print_value(t, address, "voltage", TR_VOLTAGE1);
+	print_value(t, address, "current", TR_CURRENT1);
       } else if (t->transducers[address].type == TR_3PHASE4WIRE) {
-	printf("voltage1: %f\n", t->transducers[address].voltage_f1 * t->transducers[address].max_volts);
-	printf("current1: %f\n", t->transducers[address].current_f1 * t->transducers[address].max_amps);
-	printf("voltage2: %f\n", t->transducers[address].voltage_f2 * t->transducers[address].max_volts);
-	printf("current2: %f\n", t->transducers[address].current_f2 * t->transducers[address].max_amps);
-	printf("voltage3: %f\n", t->transducers[address].voltage_f3 * t->transducers[address].max_volts);
-	printf("current3: %f\n", t->transducers[address].current_f3 * t->transducers[address].max_amps);
+	print_value(t, address, "voltage1", TR_VOLTAGE1);
+	print_value(t, address, "current1", TR_CURRENT1);
+	print_value(t, address, "voltage2", TR_VOLTAGE2);
+	print_value(t, address, "current2", TR_CURRENT2);
+	print_value(t, address, "voltage3", TR_VOLTAGE3);
+	print_value(t, address, "current3", TR_CURRENT3);
       }
-      printf("real_power: %f\n", t->transducers[address].power_f * t->transducers[address].max_volts * t->transducers[address].max_amps);
-      printf("reactive_power: %f\n", t->transducers[address].vars_f * t->transducers[address].max_volts * t->transducers[address].max_amps);
-      printf("frequency: %f\n", t->transducers[address].frequency);
-      printf("kwhr: %f\n", (double) t->transducers[address].kwhr * t->transducers[address].max_volts * t->transducers[address].max_amps / 3600000.0);
-      printf("kvarhr: %f\n", (double) t->transducers[address].kvarhr * t->transducers[address].max_volts * t->transducers[address].max_amps / 3600000.0);
+      print_value(t, address, "real_power", TR_POWER);
+      print_value(t, address, "reactive_power", TR_VARS);
+      print_value(t, address, "frequency", TR_FREQUENCY);
+      print_value(t, address, "kwhr", TR_KWHR);
+      print_value(t, address, "kvarhr", TR_KVARHR);
       success = EXIT_SUCCESS;
     } else {
-      fprintf(stderr, "Unable to read transducer.\n");
+      print_error(result, "Unable to read transducer.");
     }
   } else {
-    fprintf(stderr, "Unknown transducer model.\n");
+    print_error(result, "Unknown transducer model.");
   }
 
   return success;
@@ -142,27 +296,81 @@ int action_read(transducer *t, char *device, int address)
 int action_clear_energy(transducer *t, char *device, int address)
 {
   int success = EXIT_FAILURE;
+  int result;
 
-  if (TR_OK == tr_identify(t, address)) {
-    if (TR_OK == tr_clear_energy(t, address)) {
+  if (TR_OK == (result = tr_identify(t, address))) {
+    if (TR_OK == (result = tr_clear_energy(t, address))) {
       success = EXIT_SUCCESS;
     } else {
-      fprintf(stderr, "Unable to clear transducer energy values.\n");
+      print_error(result, "Unable to clear transducer energy values.");
     }
   } else {
-    fprintf(stderr, "Unknown transducer model.\n");
+    print_error(result, "Unknown transducer model.");
   }
 
   return success;
 }
 
+static long footprint_row(const char *what, long size)
+{
+  printf("%-32s %9ld bytes\n", what, size);
+  return size;
+}
+
+/**
+ * Prints the memory which the poller allocates at startup. Reading the
+ * transducers, publishing, writing the state and cache files and running
+ * alarm hooks allocate nothing more; reloading the configuration and
+ * writing burst files do, see the README.
+ */
+void footprint(poller *p, int tracing)
+{
+  long total = 0;
+  sink *s;
+
+  total += footprint_row("transducer handle", sizeof(transducer));
+  total += footprint_row("poller", sizeof(poller));
+  total += footprint_row("publisher ring", sizeof(ring) + PUBLISHER_RING * sizeof(sample));
+  for (s = p->sinks; s != NULL; s = s->next) {
+    total += footprint_row(s->spec, sizeof(sink) + s->size);
+  }
+  if (p->alarms) {
+    total += footprint_row("alarm rules", sizeof(alarms));
+    if (p->alarms->envp) {
+      total += footprint_row("alarm hook environment", (p->alarms->envc + 5) * sizeof(char *));
+    }
+  }
+  if (p->state) {
+    total += footprint_row("state buffer", STATE_SIZE);
+  }
+  if (tracing) {
+    total += footprint_row("trace buffers", sizeof(trace) + 2 * TRACE_BUFFER);
+  }
+  footprint_row("total", total);
+#ifdef HEAPFREE
+  printf("Heap free build, strings never allocate.\n");
+#endif
+}
+
 /**
  * Main program.
  */
 int main(int argc, char *argv[])
 {
   transducer *t = NULL;
+  poller *p = NULL;
   char *device = NULL;
+  char *capture = NULL;
+  char *replay = NULL;
+  char *tracefile = NULL;
+  int replay_speed = SER_REPLAY_ORIGINAL;
+  char *config = NULL;
+  conf *c = NULL;
+  char *ratios[256];
+  int num_ratios = 0;
+  char *sinks[16];
+  int num_sinks = 0;
+  int i;
   int optc;
 
   int scan = 0;
@@ -172,6 +380,18 @@ int main(int argc, char *argv[])
   int set_address = 0;
   int reset = 0;
   int force = 0;
+  int poll = 0;
+  int show_footprint = 0;
+  int plan = 0;
+  int calibrate = 0;
+  int verbose = 0;
+  int lock_wait = LOCK_WAIT_DEFAULT;
+  int timeout_min = 0;
+  int timeout_max = 0;
+  int baud = 0;
+  int burst_address = -1;
+  int burst_seconds = 0;
+  long long max_age = -1;
 
   int address = -1;
 
@@ -179,13 +399,21 @@ int main(int argc, char *argv[])
 
   progname = argv[0];
 
+  /* The poller is configured while parsing the options and gets the
+     transducer handle later on. */
+  p = poller_alloc(NULL);
+  if (p == NULL) {
+    fprintf(stderr, "Unable to allocate memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
   while ((optc = getopt_long(argc, argv, "hvVd:i:r:c:", long_options, (int *) 0)) != EOF) {
     switch (optc) {
     case 'h':
       help();
       exit(EXIT_SUCCESS);
     case 'V':
-      tr_set_verbose(1);
+      verbose = 1;
       break;
     case 'd':
       device = optarg;
@@ -215,6 +443,197 @@ int main(int argc, char *argv[])
     case 'f':
       force = 1;
       break;
+    case 'P':
+      poll = 1;
+      break;
+    case 'm':
+      if (0 > poller_add_meter(p, atoi(optarg), POLLER_CLI)) {
+	fprintf(stderr, "Invalid address `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'Q':
+      if (0 > (i = poller_add_meter(p, atoi(optarg), POLLER_CLI))) {
+	fprintf(stderr, "Invalid address `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      p->meters[i].fast = 1;
+      break;
+    case 'G':
+      if (0 > poller_add_group(p, optarg, 0, POLLER_CLI)) {
+	fprintf(stderr, "Invalid group `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'e':
+      if (0 != conf_parse_range(optarg, &timeout_min, &timeout_max)) {
+	fprintf(stderr, "Invalid timeout range `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'g':
+      baud = atoi(optarg);
+      break;
+    case 'O':
+      show_footprint = 1;
+      break;
+    case 'p':
+      plan = 1;
+      break;
+    case 'I':
+      if (1 != sscanf(optarg, "%d", &calibrate) || calibrate < 1) {
+	usage();
+      }
+      break;
+    case 'Z':
+      p->state = optarg;
+      break;
+    case 'x':
+      if (2 != sscanf(optarg, "%d:%d", &burst_address, &burst_seconds) ||
+	  burst_address < 0 || burst_address > 255 || burst_seconds <= 0) {
+	fprintf(stderr, "Invalid burst `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'y':
+      p->burst_dir = optarg;
+      break;
+    case 'w':
+      p->burst_keepalive = atoi(optarg) * 1000LL;
+      if (p->burst_keepalive <= 0) {
+	usage();
+      }
+      break;
+    case 'N':
+      p->control = optarg;
+      break;
+    case 'E':
+      if (0 > (max_age = conf_parse_ms(optarg))) {
+	usage();
+      }
+      break;
+    case 'q':
+      p->cache = 1;
+      break;
+    case 'z':
+      p->state_interval = atoi(optarg) * 1000LL;
+      if (p->state_interval <= 0) {
+	usage();
+      }
+      break;
+    case 'U':
+      if (0 > poller_add_virtual(p, optarg, POLLER_CLI)) {
+	fprintf(stderr, "Invalid virtual meter `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'n':
+      p->interval = atoi(optarg) * 1000LL;
+      if (p->interval <= 0) {
+	usage();
+      }
+      break;
+    case 'D':
+      if (0 != deadband_set(&p->deadband, optarg)) {
+	fprintf(stderr, "Invalid deadband `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'H':
+      p->deadband.heartbeat = atoi(optarg) * 1000LL;
+      break;
+    case 'X':
+      p->discover = 1;
+      break;
+    case 'T':
+      p->probe_timeout = atoi(optarg);
+      if (p->probe_timeout <= 0) {
+	usage();
+      }
+      break;
+    case 'A':
+      p->age_out = atoi(optarg) * 1000LL;
+      break;
+    case 'K':
+      p->failures_max = atoi(optarg);
+      if (p->failures_max <= 0) {
+	usage();
+      }
+      break;
+    case 'M':
+      p->backoff_max = atoi(optarg) * 1000LL;
+      if (p->backoff_max <= 0) {
+	usage();
+      }
+      break;
+    case 'C':
+      capture = optarg;
+      break;
+    case 'Y':
+      replay = optarg;
+      break;
+    case 't':
+      tracefile = optarg;
+      break;
+    case 'F':
+      config = optarg;
+      break;
+    case 'o':
+      if (num_ratios == sizeof(ratios) / sizeof(ratios[0])) {
+	usage();
+      }
+      ratios[num_ratios++] = optarg;
+      break;
+    case 'k':
+      if (num_sinks == sizeof(sinks) / sizeof(sinks[0])) {
+	usage();
+      }
+      sinks[num_sinks++] = optarg;
+      break;
+    case 'b':
+      p->sink_batch_size = atoi(optarg);
+      break;
+    case 'B':
+      p->sink_batch_age = atoi(optarg);
+      break;
+    case 'u':
+      p->sink_buffer = atoi(optarg);
+      break;
+    case 'L':
+      p->spill = optarg;
+      break;
+    case 'W':
+      lock_wait = atoi(optarg);
+      if (lock_wait < 0) {
+	usage();
+      }
+      break;
+    case 'l':
+      if (NULL == poller_alarms(p) || 0 != alarm_add(p->alarms, optarg)) {
+	fprintf(stderr, "Invalid alarm `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'j':
+      if (NULL == poller_alarms(p) || 0 != alarm_set_hook(p->alarms, optarg)) {
+	usage();
+      }
+      break;
+    case 'J':
+      if (NULL == poller_alarms(p) || 0 != alarm_set_sink(p->alarms, optarg)) {
+	fprintf(stderr, "Unable to create sink `%s'.\n", optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      if (0 == strcmp(optarg, "original")) {
+	replay_speed = SER_REPLAY_ORIGINAL;
+      } else if (0 == strcmp(optarg, "max")) {
+	replay_speed = SER_REPLAY_MAX;
+      } else {
+	usage();
+      }
+      break;
     case 'v':
       printf("%s\n", version);
       exit(EXIT_SUCCESS);      
@@ -223,26 +642,124 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (device == NULL) {
+  if (config != NULL) {
+    if (NULL == (c = conf_load(config))) {
+      exit(EXIT_FAILURE);
+    }
+    if (device == NULL) {
+      device = c->device;
+    }
+    if (baud == 0 && c->baud > 0) {
+      baud = c->baud;
+    }
+  }
+
+  if (device == NULL && replay == NULL && !show_footprint && !(plan && calibrate == 0)) {
     usage();
   }
 
-  t = tr_alloc();
+  for (i = 0; i < num_sinks; i++) {
+    sink *s = sink_alloc(sinks[i], p->sink_buffer, p->spill);
+    if (s == NULL) {
+      fprintf(stderr, "Unable to create sink `%s'.\n", sinks[i]);
+      exit(EXIT_FAILURE);
+    }
+    s->batch_size = p->sink_batch_size;
+    s->batch_age = p->sink_batch_age;
+    poller_add_sink(p, s);
+  }
+
+  if (NULL == (t = tr_alloc())) {
+    fprintf(stderr, "Unable to allocate memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  tr_set_verbose(t, verbose);
+  tr_set_lock_wait(t, lock_wait);
+  if (baud != 0 && TR_OK != tr_set_baud(t, baud)) {
+    fprintf(stderr, "Unsupported baud rate %d.\n", baud);
+    exit(EXIT_FAILURE);
+  }
+  if (timeout_min > 0) {
+    tr_set_auto_timeout(t, timeout_min, timeout_max);
+  }
+
+  for (i = 0; i < num_ratios; i++) {
+    char ct[32], pt[32] = "1";
+    int n;
+
+    if (sscanf(ratios[i], "%d:%31[^:]:%31s", &n, ct, pt) < 2 ||
+	n < 0 || n > 255 || TR_OK != tr_set_ratio(t, n, conf_parse_ratio(ct), conf_parse_ratio(pt))) {
+      fprintf(stderr, "Invalid ratio `%s'.\n", ratios[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  p->t = t;
+  p->device = device;
+  if (c != NULL) {
+    if (0 != conf_apply(c, p)) {
+      exit(EXIT_FAILURE);
+    }
+    p->config = config;
+    p->config_watch = conf_watch(config);
+  }
+
+  if (show_footprint) {
+    footprint(p, tracefile != NULL);
+    exit(EXIT_SUCCESS);
+  }
+
+  if (plan && p->num_meters == 0) {
+    usage();
+  } else if (plan && calibrate == 0) {
+    /* Estimates need no bus */
+    exit(plan_run(p, 0));
+  }
 
   /* Try to open device */
-  if (TR_OK != tr_open(t, device)) {
+  if (replay != NULL && TR_OK != tr_open_replay(t, replay, replay_speed)) {
+    fprintf(stderr, "Unable to open capture file `%s'.\n", replay);
+    success = EXIT_FAILURE;
+  } else if (replay == NULL && TR_OK != tr_open(t, device)) {
     fprintf(stderr, "Unable to open device `%s'.\n", device);
     success = EXIT_FAILURE;
+  } else if (capture != NULL && TR_OK != tr_capture(t, capture)) {
+    fprintf(stderr, "Unable to create capture file `%s'.\n", capture);
+    tr_close(t);
+    success = EXIT_FAILURE;
+  } else if (tracefile != NULL && TR_OK != tr_trace(t, tracefile)) {
+    fprintf(stderr, "Unable to create trace file `%s'.\n", tracefile);
+    tr_close(t);
+    success = EXIT_FAILURE;
   } else {
     if (identify) {
       /* Identify a transducer. */
       success = action_identify(t, device, address);
     } else if (readvalues) {
       /* Get live values. */
-      success = action_read(t, device, address);
+      success = action_read(t, device, address, max_age);
     } else if (clear) {
       /* Clear energy totalizer. */
       success = action_clear_energy(t, device, address);
+    } else if (plan) {
+      /* Time the transducers and plan with the timings. */
+      success = plan_run(p, calibrate);
+    } else if (poll || burst_address >= 0) {
+      /* Poll transducers forever, or just for a burst. */
+      if (!poll) {
+	p->burst_exit = 1;
+      } else if (p->num_meters == 0 && !p->discover) {
+	usage();
+      }
+      if (burst_address >= 0) {
+	poller_burst(p, burst_address, burst_seconds * 1000LL);
+      }
+      the_poller = p;
+      signal(SIGINT, stop_poller);
+      signal(SIGTERM, stop_poller);
+      signal(SIGHUP, reload_poller);
+      signal(SIGPIPE, SIG_IGN);
+      poller_run(p);
     } else if (scan) {
       printf("%d transducers found.\n", tr_scan(t));
     } else if (set_address) {
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "plan.h"
+#include "state.h"
+#include "timer.h"
+
+/* The exchanges of a poll */
+#define IDENTIFY 0
+#define READ 1
+#define ENERGY 2
+#define EXCHANGES 3
+
+/* Where the duration of the exchanges of an address comes from */
+#define WIRE 0
+#define HISTORY 1
+#define MEASURED 2
+#define NO_ANSWER 3
+
+static const char *sources[] = { "wire", "history", "measured", "no answer" };
+
+/* Commands are "$NNM", "#NNA" and "#NNW", replies are as long as
+   decode_identify(), decode_read() and decode_energy() expect, all
+   followed by CR. Single phase and three phase models. */
+#define COMMAND_BYTES 5
+static const int reply_bytes[2][EXCHANGES] = {
+  { 18, 43, 20 },
+  { 17, 71, 20 }
+};
+
+static int (*exchanges[EXCHANGES])(transducer *t, int n) = {
+  tr_identify, tr_read, tr_read_energy
+};
+
+struct address {
+  int model;
+  int known;
+  int source;
+  long long time[EXCHANGES];
+  long long worst[EXCHANGES];
+};
+
+static int model_of(transducer *t, int n)
+{
+  return t->transducers[n].type == TR_1PHASE ? 0 : 1;
+}
+
+/* Ten bits per byte on the wire (us) */
+static long long wire_time(transducer *t, int bytes)
+{
+  return bytes * 10000000LL / t->baud;
+}
+
+/**
+ * Estimates the exchanges of a model from the wire time of command and
+ * reply, and the time the transducer takes to answer. The latency
+ * recorded by the transducer handle covers the command as well.
+ */
+static void estimate(transducer *t, struct address *a, long long latency)
+{
+  int k;
+
+  for (k = 0; k < EXCHANGES; k++) {
+    if (latency < 0) {
+      a->time[k] = wire_time(t, COMMAND_BYTES) + PLAN_TURNAROUND;
+    } else {
+      a->time[k] = latency;
+    }
+    a->time[k] += wire_time(t, reply_bytes[a->model][k]);
+    a->worst[k] = a->time[k];
+  }
+}
+
+/**
+ * Times rounds of all exchanges with address n. Returns the number of
+ * exchanges which failed, or -1 if the transducer does not answer at
+ * all.
+ */
+static int calibrate(transducer *t, int n, int rounds, struct address *a)
+{
+  long long start, us;
+  int failed = 0;
+  int ok[EXCHANGES] = { 0 };
+  int r, k;
+
+  if (TR_OK != tr_identify(t, n)) {
+    return -1;
+  }
+  a->model = model_of(t, n);
+  a->known = 1;
+  a->source = MEASURED;
+  for (k = 0; k < EXCHANGES; k++) {
+    a->time[k] = a->worst[k] = 0;
+  }
+
+  for (r = 0; r < rounds; r++) {
+    for (k = 0; k < EXCHANGES; k++) {
+      start = timer_now_ns();
+      if (TR_OK != exchanges[k](t, n)) {
+	failed++;
+	continue;
+      }
+      us = (timer_now_ns() - start) / 1000;
+      a->time[k] += us;
+      if (us > a->worst[k]) {
+	a->worst[k] = us;
+      }
+      ok[k]++;
+    }
+  }
+
+  for (k = 0; k < EXCHANGES; k++) {
+    if (ok[k] == 0) {
+      return -1;
+    }
+    a->time[k] /= ok[k];
+  }
+  return failed;
+}
+
+static void print_ms(long long us)
+{
+  printf(" %6lld.%lld", us / 1000, us % 1000 / 100);
+}
+
+/**
+ * Prints how much of the bus the configured meters take, how old their
+ * readings get at worst, and how many meters the bus could take at the
+ * poll interval. The exchanges are timed on the bus for rounds rounds per
+ * meter, or else estimated from the latencies in the state file and the
+ * wire time. Returns EXIT_FAILURE if the meters need more than the bus.
+ */
+int plan_run(poller *p, int rounds)
+{
+  static struct address addresses[256];
+  transducer *t = p->t;
+  long long cost[256];
+  long long interval[256];
+  long long round = 0, fast = 0, model_cost[2] = { 0, 0 };
+  int model_count[2] = { 0, 0 };
+  double use = 0;
+  char label[64];
+  int i, g, k, m;
+
+  if (p->state != NULL && 0 > state_load(p, p->state)) {
+    fprintf(stderr, "No state in `%s', latencies are estimated.\n", p->state);
+  }
+
+  for (i = 0; i < p->num_meters; i++) {
+    int n = p->meters[i].address;
+    struct address *a = &addresses[n];
+
+    a->known = p->meters[i].identified;
+    a->model = a->known ? model_of(t, n) : 1;
+    a->source = (tr_latency(t, n, 50) < 0) ? WIRE : HISTORY;
+    estimate(t, a, tr_latency(t, n, 50));
+
+    if (rounds > 0 && 0 != (k = calibrate(t, n, rounds, a))) {
+      if (k < 0) {
+	/* The poller waits for it until it gives up */
+	a->source = NO_ANSWER;
+	a->time[IDENTIFY] = a->worst[IDENTIFY] = tr_timeout(t, n) * 1000LL;
+	a->time[READ] = a->worst[READ] = tr_timeout(t, n) * 1000LL;
+	a->time[ENERGY] = a->worst[ENERGY] = 0;
+      } else {
+	fprintf(stderr, "%d of %d exchanges with transducer %d failed.\n",
+		k, rounds * EXCHANGES, n);
+      }
+    }
+
+    if (p->meters[i].group >= 0) {
+      g = p->meters[i].group;
+      interval[i] = p->groups[g].interval ? p->groups[g].interval : p->interval;
+    } else {
+      interval[i] = p->meters[i].interval ? p->meters[i].interval : p->interval;
+    }
+
+    /* Fast meters are read on every pass, the totalizers once per
+       interval */
+    if (p->meters[i].fast) {
+      cost[i] = a->time[ENERGY];
+      fast += a->time[READ];
+    } else {
+      cost[i] = a->time[READ] + a->time[ENERGY];
+    }
+    round += a->worst[READ] + a->worst[ENERGY];
+    use += cost[i] / (interval[i] * 1000.0);
+
+    if (a->source != NO_ANSWER) {
+      model_cost[a->model] += a->time[READ] + a->time[ENERGY];
+      model_count[a->model]++;
+    }
+  }
+
+  printf("Bus%s%s at %d baud, poll interval %lld s\n\n",
+	 p->device != NULL ? " " : "", p->device != NULL ? p->device : "",
+	 t->baud, p->interval / 1000);
+  printf("%7s  %-8s  %-9s %8s %8s %8s %9s %8s %10s\n", "Address", "Model",
+	 "Source", "Identify", "Read", "Energy", "Interval", "Bus use", "Staleness");
+  printf("%7s  %-8s  %-9s %8s %8s %8s %9s %8s %10s\n", "", "", "",
+	 "(ms)", "(ms)", "(ms)", "(s)", "(%)", "(s)");
+
+  for (i = 0; i < p->num_meters; i++) {
+    int n = p->meters[i].address;
+    struct address *a = &addresses[n];
+
+    printf("%7d  %-7s%c  %-9s", n, a->model == 0 ? "1-phase" : "3-phase",
+	   a->known ? ' ' : '?', sources[a->source]);
+    for (k = 0; k < EXCHANGES; k++) {
+      print_ms(a->time[k]);
+    }
+    if (p->meters[i].fast) {
+      printf(" %9s", "fast");
+    } else {
+      printf(" %9lld", interval[i] / 1000);
+    }
+    printf(" %8.2f", cost[i] * 100.0 / (interval[i] * 1000.0));
+    /* Due just after everything else came due at once, readings of fast
+       meters wait for one pass */
+    if (p->meters[i].fast) {
+      printf(" %10.1f\n", round / 1000000.0);
+    } else {
+      printf(" %10.1f\n", interval[i] / 1000.0 + round / 1000000.0);
+    }
+  }
+
+  for (g = 0; g < p->num_groups; g++) {
+    long long skew = 0;
+
+    /* From the first to the last reply of the instantaneous values */
+    for (k = 1; k < p->groups[g].num_members; k++) {
+      skew += addresses[p->groups[g].members[k]].worst[READ];
+    }
+    printf("\nGroup %s: %d meters, snapshot skew up to %.1f ms",
+	   p->groups[g].name, p->groups[g].num_members, skew / 1000.0);
+  }
+
+  printf("\n\n%-40s %10.2f %%\n", "Bus utilisation", use * 100);
+  printf("%-40s %10.1f ms\n", "Longest pass", round / 1000.0);
+  if (fast > 0) {
+    printf("%-40s %10.1f ms\n", "Fast meters, read every",
+	   use < 1 ? fast / (1 - use) / 1000.0 : 0);
+  }
+  for (m = 0; m < 2; m++) {
+    struct address a;
+    long long each;
+
+    if (model_count[m] > 0) {
+      each = model_cost[m] / model_count[m];
+    } else {
+      a.model = m;
+      estimate(t, &a, -1);
+      each = a.time[READ] + a.time[ENERGY];
+    }
+    k = p->interval * 1000 * PLAN_HEADROOM / 100 / each;
+    snprintf(label, sizeof(label), "Maximum %s meters (%d %% of %lld s)",
+	     m == 0 ? "1-phase" : "3-phase", PLAN_HEADROOM, p->interval / 1000);
+    printf("%-40s %10d%s\n", label, k > 255 ? 255 : k,
+	   k > 255 ? " (all addresses)" : "");
+  }
+
+  if (use > 1 || (fast > 0 && use >= 1)) {
+    fprintf(stderr, "The meters need more than the bus can do.\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __PLAN_H
+#define __PLAN_H
+
+#include "poller.h"
+
+/* Share of the bus up to which meters are added by the planner (%) */
+#define PLAN_HEADROOM 80
+
+/* Time (us) a transducer is assumed to take before it starts to answer,
+   unless it was measured */
+#define PLAN_TURNAROUND 10000
+
+int plan_run(poller *p, int rounds);
+
+#endif /* __PLAN_H */
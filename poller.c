@@ -0,0 +1,1160 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/select.h>
+
+#include "poller.h"
+#include "conf.h"
+#include "publisher.h"
+#include "state.h"
+#include "cache.h"
+#include "timer.h"
+
+/* Number of addresses probed at most per idle period */
+#define PROBES_MAX 4
+
+/* Time needed for a probe in addition to the timeout (ms) */
+#define PROBE_OVERHEAD 20
+
+/* Step through the address space, coprime to 256 so that every address
+   is visited once per round while consecutive probes are spread out. */
+#define PROBE_STRIDE 97
+
+/**
+ * The poller's clock. When replaying a capture at maximum speed, waiting
+ * is skipped by moving this clock forward instead.
+ */
+long long poller_now(poller *p)
+{
+  return timer_now_ms() + atomic_load(&p->clock_offset);
+}
+
+static void sleep_ms(poller *p, long long ms)
+{
+  if (ms <= 0) {
+    return;
+  }
+  if (p->t->ser.replay && p->t->ser.replay_speed == SER_REPLAY_MAX) {
+    atomic_fetch_add(&p->clock_offset, ms);
+  } else if (p->bus_wakeup >= 0) {
+    /* Wake up early if the configuration changes */
+    fd_set readfds;
+    struct timeval tv;
+    uint64_t events;
+
+    FD_ZERO(&readfds);
+    FD_SET(p->bus_wakeup, &readfds);
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    if (select(p->bus_wakeup + 1, &readfds, NULL, NULL, &tv) > 0) {
+      read(p->bus_wakeup, &events, sizeof(events));
+    }
+  } else {
+    timer_sleep_ms(ms);
+  }
+}
+
+static long long meter_interval(poller *p, int i)
+{
+  return p->meters[i].interval ? p->meters[i].interval : p->interval;
+}
+
+poller *poller_alloc(transducer *t)
+{
+  poller *p;
+  int i;
+
+  if (NULL == (p = malloc(sizeof(poller)))) {
+    return NULL;
+  }
+  p->t = t;
+  p->stop = 0;
+  p->device = NULL;
+  p->config = NULL;
+  p->reload = 0;
+  p->config_watch = -1;
+  p->defaults = NULL;
+  p->pending = NULL;
+  p->bus_wakeup = -1;
+  p->ring = NULL;
+  p->wakeup = -1;
+  atomic_init(&p->publisher_stop, 0);
+  for (i = 0; i < 4; i++) {
+    atomic_init(&p->forget[i], 0);
+  }
+  for (i = 0; i < 256; i++) {
+    atomic_init(&p->forget_at[i], 0);
+  }
+  atomic_init(&p->burst_end, 0);
+  atomic_init(&p->burst_end_at, 0);
+  atomic_init(&p->clock_offset, 0);
+  p->interval = 60000;
+  p->num_meters = 0;
+  p->num_groups = 0;
+  p->epoch = 0;
+  p->num_virtuals = 0;
+  p->discover = 0;
+  p->probe_timeout = 100;
+  p->probe_cursor = 0;
+  p->age_out = 0;
+  p->failures_max = 3;
+  p->backoff_max = 600000;
+  atomic_init(&p->burst_request, 0);
+  p->burst_address = -1;
+  p->burst_until = 0;
+  p->burst_keepalive = 60000;
+  p->burst_exit = 0;
+  p->burst_dir = NULL;
+  p->burst_file = NULL;
+  p->burst_count = 0;
+  p->control = NULL;
+  p->control_fd = -1;
+  p->cache = 0;
+  p->cache_files = NULL;
+  p->state = NULL;
+  p->state_interval = 60000;
+  p->state_next = 0;
+  p->state_buf = NULL;
+  atomic_init(&p->state_len, 0);
+  p->sinks = NULL;
+  p->sink_batch_size = SINK_BATCH_SIZE;
+  p->sink_batch_age = SINK_BATCH_AGE;
+  p->sink_buffer = SINK_BUFFER;
+  p->spill = NULL;
+  p->alarms = NULL;
+  deadband_init(&p->deadband);
+  return p;
+}
+
+void poller_free(poller *p)
+{
+  struct conf *c = atomic_exchange(&p->pending, NULL);
+
+  if (c) {
+    conf_free(c);
+  }
+  if (p->defaults) {
+    conf_free(p->defaults);
+  }
+  while (p->sinks) {
+    sink *s = p->sinks;
+    p->sinks = s->next;
+    sink_free(s);
+  }
+  alarm_free(p->alarms);
+  cache_free(p->cache_files);
+  free(p->state_buf);
+  free(p);
+}
+
+void poller_add_sink(poller *p, sink *s)
+{
+  s->next = p->sinks;
+  p->sinks = s;
+}
+
+/**
+ * Returns the alarm rules, which are created when first needed.
+ */
+alarms *poller_alarms(poller *p)
+{
+  if (p->alarms == NULL) {
+    p->alarms = alarm_alloc();
+  }
+  return p->alarms;
+}
+
+/**
+ * Hands a reloaded configuration to the bus loop, which applies it
+ * between two polls and frees it.
+ */
+void poller_reconfigure(poller *p, struct conf *c)
+{
+  uint64_t one = 1;
+
+  if (NULL != (c = atomic_exchange(&p->pending, c))) {
+    /* Superseded before the bus loop got to it */
+    conf_free(c);
+  }
+  if (p->bus_wakeup >= 0) {
+    write(p->bus_wakeup, &one, sizeof(one));
+  }
+}
+
+/**
+ * Requests a burst of length ms on the given address. May be called from
+ * any thread; the bus loop starts the burst before its next poll. Returns
+ * -1 if the request is invalid.
+ */
+int poller_burst(poller *p, int address, long long length)
+{
+  uint64_t one = 1;
+
+  if (address < 0 || address > 255 || length <= 0) {
+    return -1;
+  }
+  atomic_store(&p->burst_request, (length << 8) | address);
+  if (p->bus_wakeup >= 0) {
+    write(p->bus_wakeup, &one, sizeof(one));
+  }
+  return 0;
+}
+
+/**
+ * Adds a meter to the polled set and returns its index, or -1 if the
+ * address is invalid.
+ */
+int poller_add_meter(poller *p, int address, int origin)
+{
+  int i;
+
+  if (address < 0 || address > 255) {
+    return -1;
+  }
+  if ((i = poller_find_meter(p, address)) >= 0) {
+    return i;
+  }
+  p->meters[p->num_meters].address = address;
+  p->meters[p->num_meters].origin = origin;
+  p->meters[p->num_meters].identified = 0;
+  p->meters[p->num_meters].group = -1;
+  p->meters[p->num_meters].epoch = 0;
+  p->meters[p->num_meters].interval = 0;
+  p->meters[p->num_meters].next = 0;
+  p->meters[p->num_meters].failures = 0;
+  p->meters[p->num_meters].backoff = 0;
+  p->meters[p->num_meters].fast = 0;
+  p->meters[p->num_meters].sampled = 0;
+  p->meters[p->num_meters].reconcile = 0;
+  p->meters[p->num_meters].last_ok = poller_now(p);
+  p->meters[p->num_meters].stamp = 0;
+  p->meters[p->num_meters].revalidate = 0;
+  return p->num_meters++;
+}
+
+void poller_remove_meter(poller *p, int i)
+{
+  if (p->meters[i].backoff != 0) {
+    tr_set_timeout(p->t, p->meters[i].address, 0);
+  }
+  p->num_meters--;
+  p->meters[i] = p->meters[p->num_meters];
+}
+
+int poller_find_meter(poller *p, int address)
+{
+  int i;
+
+  for (i = 0; i < p->num_meters; i++) {
+    if (p->meters[i].address == address) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static long long group_interval(poller *p, int g)
+{
+  return p->groups[g].interval ? p->groups[g].interval : p->interval;
+}
+
+/**
+ * Marks every meter with the group it belongs to. A meter belongs to the
+ * first group listing it.
+ */
+static void assign_groups(poller *p)
+{
+  int i, g, k;
+
+  for (i = 0; i < p->num_meters; i++) {
+    p->meters[i].group = -1;
+  }
+  for (g = p->num_groups - 1; g >= 0; g--) {
+    for (k = 0; k < p->groups[g].num_members; k++) {
+      if ((i = poller_find_meter(p, p->groups[g].members[k])) >= 0) {
+	p->meters[i].group = g;
+      }
+    }
+  }
+}
+
+/**
+ * Checks the name of a group or virtual meter of len characters. Names
+ * go into the tags of InfluxDB line protocol as they are, so only
+ * letters, digits, '_', '.' and '-' are allowed. A virtual meter takes
+ * the place of an address, so unless numeric is set, the name must not
+ * be a number. Returns 1 if the name is valid.
+ */
+static int valid_name(const char *name, int len, int numeric)
+{
+  int digits = 0;
+  int i;
+
+  if (len == 0 || len >= POLLER_GROUP_NAME) {
+    return 0;
+  }
+  for (i = 0; i < len; i++) {
+    if (isdigit((unsigned char) name[i])) {
+      digits++;
+    } else if (!isalpha((unsigned char) name[i]) && !strchr("_.-", name[i])) {
+      return 0;
+    }
+  }
+  return numeric || digits < len;
+}
+
+/**
+ * Parses "name=address,address,..." into the members of a group. Returns
+ * their number, or -1 if the specification is invalid.
+ */
+static int parse_group(const char *spec, int *members)
+{
+  const char *eq = strchr(spec, '=');
+  const char *s;
+  int num = 0;
+
+  if (eq == NULL || !valid_name(spec, eq - spec, 1)) {
+    return -1;
+  }
+  for (s = eq + 1; *s; ) {
+    char *e;
+    long n = strtol(s, &e, 10);
+
+    if (e == s || n < 0 || n > 255 || num == 256 || (*e != ',' && *e != '\0')) {
+      return -1;
+    }
+    members[num++] = n;
+    s = (*e == ',') ? e + 1 : e;
+  }
+  return (num > 0) ? num : -1;
+}
+
+/**
+ * Returns 0 if spec is a valid group, without adding it.
+ */
+int poller_check_group(const char *spec)
+{
+  int members[256];
+
+  return (parse_group(spec, members) > 0) ? 0 : -1;
+}
+
+/**
+ * Adds a group of meters given as "name=address,address,...", read once
+ * per interval (ms, 0 for the poll interval). The members are added to
+ * the polled meters. A group of the same name is replaced, but keeps its
+ * schedule. Returns the group's index, or -1 if the specification is
+ * invalid.
+ */
+int poller_add_group(poller *p, const char *spec, long long interval, int origin)
+{
+  const char *eq = strchr(spec, '=');
+  int members[256];
+  int num;
+  int g, k;
+
+  if (interval < 0 || 0 > (num = parse_group(spec, members))) {
+    return -1;
+  }
+
+  for (g = 0; g < p->num_groups; g++) {
+    if (0 == strncmp(p->groups[g].name, spec, eq - spec) &&
+	p->groups[g].name[eq - spec] == '\0') {
+      break;
+    }
+  }
+  if (g == POLLER_GROUPS) {
+    return -1;
+  }
+  if (g == p->num_groups) {
+    memcpy(p->groups[g].name, spec, eq - spec);
+    p->groups[g].name[eq - spec] = '\0';
+    p->groups[g].next = 0;
+    p->num_groups++;
+  }
+  p->groups[g].origin = origin;
+  p->groups[g].interval = interval;
+  p->groups[g].num_members = num;
+  for (k = 0; k < num; k++) {
+    p->groups[g].members[k] = members[k];
+    if (poller_find_meter(p, members[k]) < 0) {
+      poller_add_meter(p, members[k], origin);
+    }
+  }
+  assign_groups(p);
+  return g;
+}
+
+/**
+ * Removes group g. Its members stay, and are polled on their own again.
+ */
+void poller_remove_group(poller *p, int g)
+{
+  p->num_groups--;
+  memmove(&p->groups[g], &p->groups[g + 1], (p->num_groups - g) * sizeof(p->groups[0]));
+  assign_groups(p);
+}
+
+/**
+ * Parses "name=address+address-address..." into the members of a virtual
+ * meter and the masks of the addresses which are added and subtracted.
+ * Returns the number of members, or -1 if the specification is invalid.
+ */
+static int parse_virtual(const char *spec, unsigned char *members, long long *add, long long *sub)
+{
+  const char *eq = strchr(spec, '=');
+  const char *s;
+  int num = 0;
+
+  if (eq == NULL || !valid_name(spec, eq - spec, 0)) {
+    return -1;
+  }
+  memset(add, 0, 256 * sizeof(long long));
+  memset(sub, 0, 256 * sizeof(long long));
+  for (s = eq + 1; *s; ) {
+    int minus = (*s == '-');
+    char *e;
+    long n;
+
+    if (*s == '+' || *s == '-') {
+      s++;
+    } else if (num > 0) {
+      return -1;
+    }
+    n = strtol(s, &e, 10);
+    if (e == s || n < 0 || n > 255 || add[n] || sub[n]) {
+      return -1;
+    }
+    if (minus) {
+      sub[n] = -1;
+    } else {
+      add[n] = -1;
+    }
+    members[num++] = n;
+    s = e;
+  }
+  return (num > 0) ? num : -1;
+}
+
+/**
+ * Returns 0 if spec is a valid virtual meter, without adding it.
+ */
+int poller_check_virtual(const char *spec)
+{
+  unsigned char members[256];
+  long long add[256];
+  long long sub[256];
+
+  return (parse_virtual(spec, members, add, sub) > 0) ? 0 : -1;
+}
+
+/**
+ * Adds a virtual meter given as "name=address+address-address...". A
+ * virtual meter of the same name is replaced. Returns its index, or -1 if
+ * the specification is invalid.
+ */
+int poller_add_virtual(poller *p, const char *spec, int origin)
+{
+  const char *eq = strchr(spec, '=');
+  long long add[256];
+  long long sub[256];
+  unsigned char members[256];
+  int num;
+  int v;
+
+  if (0 > (num = parse_virtual(spec, members, add, sub))) {
+    return -1;
+  }
+
+  for (v = 0; v < p->num_virtuals; v++) {
+    if (0 == strncmp(p->virtuals[v].name, spec, eq - spec) &&
+	p->virtuals[v].name[eq - spec] == '\0') {
+      break;
+    }
+  }
+  if (v == POLLER_VIRTUALS) {
+    return -1;
+  }
+  if (v == p->num_virtuals) {
+    memcpy(p->virtuals[v].name, spec, eq - spec);
+    p->virtuals[v].name[eq - spec] = '\0';
+    p->num_virtuals++;
+  }
+  p->virtuals[v].origin = origin;
+  p->virtuals[v].num_members = num;
+  memcpy(p->virtuals[v].members, members, num);
+  memcpy(p->virtuals[v].add, add, sizeof(add));
+  memcpy(p->virtuals[v].sub, sub, sizeof(sub));
+  return v;
+}
+
+void poller_remove_virtual(poller *p, int v)
+{
+  p->num_virtuals--;
+  memmove(&p->virtuals[v], &p->virtuals[v + 1],
+	  (p->num_virtuals - v) * sizeof(p->virtuals[0]));
+}
+
+/**
+ * Records a failed poll. After too many failures in a row the address is
+ * considered dead: it is only probed with a short timeout, at
+ * exponentially growing intervals, counted from the end of the failed
+ * attempt.
+ */
+static void poll_failed(poller *p, int i)
+{
+  int n = p->meters[i].address;
+
+  /* Identify again on the next attempt, the transducer might have been
+     replaced. */
+  p->meters[i].identified = 0;
+  p->meters[i].revalidate = 0;
+  p->meters[i].sampled = 0;
+  p->meters[i].reconcile = 0;
+  p->meters[i].failures++;
+
+  if (p->meters[i].failures < p->failures_max) {
+    return;
+  }
+
+  if (p->meters[i].backoff == 0) {
+    publish_message(p, "%d: not answering, backing off.\n", n);
+    p->meters[i].backoff = meter_interval(p, i);
+    tr_set_timeout(p->t, n, p->probe_timeout);
+  } else if (p->meters[i].backoff < p->backoff_max) {
+    p->meters[i].backoff *= 2;
+  }
+  if (p->meters[i].backoff > p->backoff_max) {
+    p->meters[i].backoff = p->backoff_max;
+  }
+  p->meters[i].next = poller_now(p) + p->meters[i].backoff;
+}
+
+/* mW ms per mWh */
+#define MS_PER_HOUR 3600000LL
+
+/**
+ * Integrates power and vars of a fast meter since its last sample
+ * (trapezoidal rule). Gaps longer than an interval are not bridged, the
+ * totalizers account for them on the next reconciliation.
+ */
+static void integrate(poller *p, int i, long long now)
+{
+  static const int fields[2] = { TR_POWER, TR_VARS };
+  int n = p->meters[i].address;
+  long long dt = now - p->meters[i].sampled;
+  int k;
+
+  for (k = 0; k < 2; k++) {
+    long long power = tr_value(p->t, n, fields[k]);
+
+    if (p->meters[i].sampled != 0 && dt <= meter_interval(p, i)) {
+      p->meters[i].rest[k] += (p->meters[i].power[k] + power) * dt / 2;
+      p->meters[i].energy[k] += p->meters[i].rest[k] / MS_PER_HOUR;
+      p->meters[i].rest[k] %= MS_PER_HOUR;
+    }
+    p->meters[i].power[k] = power;
+  }
+  p->meters[i].sampled = now;
+}
+
+/**
+ * Takes the totalizers of a fast meter as the new base of its integrated
+ * energy.
+ */
+static void reconcile(poller *p, int i)
+{
+  static const int fields[2] = { TR_KWHR, TR_KVARHR };
+  int n = p->meters[i].address;
+  int k;
+
+  for (k = 0; k < 2; k++) {
+    long long total = tr_value(p->t, n, fields[k]);
+
+    if (p->meters[i].reconcile != 0 && p->t->verbose > 0) {
+      publish_message(p, "%d: integrated %s off by %lld\n", n, tr_field_name(fields[k]),
+	              p->meters[i].energy[k] - (total - p->meters[i].base[k]));
+    }
+    p->meters[i].base[k] = total;
+    p->meters[i].energy[k] = 0;
+    p->meters[i].rest[k] = 0;
+  }
+}
+
+/**
+ * Completes the reading of a fast meter once its instantaneous values
+ * are read: integrates its energy, and reads the totalizers once per
+ * interval.
+ */
+static int fast_update(poller *p, int i)
+{
+  int n = p->meters[i].address;
+  long long now = poller_now(p);
+  int result;
+
+  integrate(p, i, now);
+
+  if (now >= p->meters[i].reconcile) {
+    if (TR_OK != (result = tr_read_energy(p->t, n))) {
+      return result;
+    }
+    reconcile(p, i);
+    p->meters[i].reconcile = now + meter_interval(p, i);
+  }
+
+  p->t->value[TR_KWHR][n] =
+    p->meters[i].base[0] + p->meters[i].energy[0];
+  p->t->value[TR_KVARHR][n] =
+    p->meters[i].base[1] + p->meters[i].energy[1];
+
+  /* Due again right away */
+  p->meters[i].next = now;
+  return TR_OK;
+}
+
+/**
+ * Reads a fast meter: power and the other instantaneous values on every
+ * call, the totalizers only once per interval.
+ */
+static int read_fast(poller *p, int i)
+{
+  int result;
+
+  if (TR_OK != (result = tr_read(p->t, p->meters[i].address))) {
+    return result;
+  }
+  return fast_update(p, i);
+}
+
+static int read_meter(poller *p, int i)
+{
+  int n = p->meters[i].address;
+  int result;
+
+  if (p->meters[i].fast) {
+    return read_fast(p, i);
+  }
+  if (TR_OK != (result = tr_read(p->t, n))) {
+    return result;
+  }
+  return tr_read_energy(p->t, n);
+}
+
+/**
+ * Identifies meter i unless this was done already. Returns 0 if the meter
+ * can be read.
+ */
+static int identify_meter(poller *p, int i)
+{
+  int n = p->meters[i].address;
+  int result;
+
+  if (p->meters[i].identified) {
+    return 0;
+  }
+  if (TR_LOCK == (result = tr_identify(p->t, n))) {
+    /* Somebody else kept the bus, not the transducer's fault */
+    publish_message(p, "%d: bus busy.\n", n);
+    return -1;
+  } else if (result != TR_OK) {
+    if (p->meters[i].backoff == 0) {
+      publish_message(p, "%d: unknown transducer model.\n", n);
+    }
+    poll_failed(p, i);
+    return -1;
+  }
+  p->meters[i].identified = 1;
+  p->meters[i].revalidate = 0;
+  publish_forget(p, n);
+
+  if (p->meters[i].backoff != 0) {
+    publish_message(p, "%d: answering again.\n", n);
+    p->meters[i].backoff = 0;
+    tr_set_timeout(p->t, n, 0);
+  }
+  return 0;
+}
+
+/**
+ * Passes the outcome of reading meter i on. The reading is stamped with
+ * stamp (wall clock, ns), or the current time if 0, and belongs to the
+ * given snapshot epoch (0 for none).
+ */
+static void read_done(poller *p, int i, int result, long long stamp, long long epoch)
+{
+  int n = p->meters[i].address;
+
+  if (result == TR_OK) {
+    p->meters[i].failures = 0;
+    p->meters[i].last_ok = poller_now(p);
+    p->meters[i].stamp = stamp ? stamp : timer_wall_ns();
+    publish_reading(p, n, p->meters[i].stamp, epoch);
+  } else if (result == TR_LOCK) {
+    publish_message(p, "%d: bus busy.\n", n);
+  } else {
+    publish_message(p, "%d: unable to read transducer.\n", n);
+    poll_failed(p, i);
+  }
+}
+
+static void poll_meter(poller *p, int i, long long now)
+{
+  p->meters[i].next = now + meter_interval(p, i);
+
+  if (0 == identify_meter(p, i)) {
+    read_done(p, i, read_meter(p, i), 0, 0);
+  }
+}
+
+/**
+ * Sums one field over all addresses: the ones selected by add minus the
+ * ones selected by sub.
+ */
+static long long virtual_sum(const long long *value, const long long *add,
+			     const long long *sub)
+{
+  long long sum = 0;
+  int n;
+
+  for (n = 0; n < 256; n++) {
+    sum += (value[n] & add[n]) - (value[n] & sub[n]);
+  }
+  return sum;
+}
+
+/**
+ * Computes and publishes the virtual meters all of whose members were
+ * read in snapshot epoch. Currents (per phase), power, vars and energy
+ * add up; the power factor follows from the sums of power and vars.
+ */
+static void compute_virtuals(poller *p, long long epoch, long long stamp)
+{
+  static const int additive[] = {
+    TR_CURRENT1, TR_CURRENT2, TR_CURRENT3, TR_POWER, TR_VARS, TR_KWHR, TR_KVARHR
+  };
+  long long value[TR_FIELDS];
+  int v, k;
+
+  for (v = 0; v < p->num_virtuals; v++) {
+    int fields = 0;
+    double apparent;
+
+    for (k = 0; k < p->virtuals[v].num_members; k++) {
+      int n = p->virtuals[v].members[k];
+      int i = poller_find_meter(p, n);
+      int f;
+
+      if (i < 0 || p->meters[i].epoch != epoch) {
+	break;
+      }
+      for (f = 0; f < sizeof(additive) / sizeof(additive[0]); f++) {
+	if (tr_has_field(p->t, n, additive[f])) {
+	  fields |= 1 << additive[f];
+	}
+      }
+    }
+    if (k < p->virtuals[v].num_members) {
+      continue;
+    }
+
+    for (k = 0; k < sizeof(additive) / sizeof(additive[0]); k++) {
+      value[additive[k]] = virtual_sum(p->t->value[additive[k]],
+				       p->virtuals[v].add, p->virtuals[v].sub);
+    }
+    apparent = hypot(value[TR_POWER], value[TR_VARS]);
+    if (apparent > 0) {
+      value[TR_PFACTOR] = llround(value[TR_POWER] / apparent * TR_FRACTION);
+      fields |= 1 << TR_PFACTOR;
+    }
+    publish_virtual(p, p->virtuals[v].name, fields, value, stamp, epoch);
+  }
+}
+
+/**
+ * Reads all members of group g as one snapshot. The instantaneous values
+ * of all members are read back to back while the bus is held, and only
+ * then the totalizers, so that the readings are as close together as
+ * the bus allows. Each reading is stamped when its reply arrived; the
+ * time from the first to the last one is reported as the skew of the
+ * snapshot.
+ */
+static void poll_group(poller *p, int g, long long now)
+{
+  int index[256];
+  int result[256];
+  long long stamp[256];
+  long long arrived[256];
+  long long first = 0, last = 0;
+  long long epoch;
+  int num = 0, read = 0;
+  int k;
+
+  p->groups[g].next = now + group_interval(p, g);
+
+  for (k = 0; k < p->groups[g].num_members && !p->stop; k++) {
+    int i = poller_find_meter(p, p->groups[g].members[k]);
+
+    /* Dead members are only probed when due */
+    if (i < 0 || (p->meters[i].backoff != 0 && p->meters[i].next > now)) {
+      continue;
+    }
+    if (0 == identify_meter(p, i)) {
+      index[num++] = i;
+    }
+  }
+
+  if (TR_OK != tr_begin(p->t)) {
+    publish_message(p, "%s: bus busy.\n", p->groups[g].name);
+    return;
+  }
+  for (k = 0; k < num; k++) {
+    result[k] = tr_read(p->t, p->meters[index[k]].address);
+    arrived[k] = timer_now_ns();
+    stamp[k] = timer_wall_ns();
+  }
+  tr_end(p->t);
+
+  for (k = 0; k < num; k++) {
+    int i = index[k];
+
+    if (result[k] != TR_OK) {
+      continue;
+    }
+    if (p->meters[i].fast) {
+      result[k] = fast_update(p, i);
+    } else {
+      result[k] = tr_read_energy(p->t, p->meters[i].address);
+    }
+  }
+
+  epoch = ++p->epoch;
+  for (k = 0; k < num; k++) {
+    read_done(p, index[k], result[k], stamp[k], epoch);
+    if (result[k] == TR_OK) {
+      p->meters[index[k]].epoch = epoch;
+      if (read == 0 || arrived[k] < first) {
+	first = arrived[k];
+      }
+      if (read == 0 || arrived[k] > last) {
+	last = arrived[k];
+      }
+      read++;
+    }
+  }
+  compute_virtuals(p, epoch, read ? stamp[0] : timer_wall_ns());
+  publish_snapshot(p, p->groups[g].name, epoch, p->groups[g].num_members, read,
+		   last - first);
+}
+
+/**
+ * Uses the time until the next scheduled poll to look for transducers at
+ * unknown addresses. A probe is only started if it completes before the
+ * deadline even if nobody answers.
+ */
+static void discover(poller *p, long long deadline)
+{
+  int probes = 0;
+  int result;
+  int tries;
+  int i;
+
+  for (tries = 0; tries < 256 && probes < PROBES_MAX; tries++) {
+    int n = p->probe_cursor;
+
+    if (p->num_meters == 256 ||
+	poller_now(p) + p->probe_timeout + PROBE_OVERHEAD > deadline) {
+      return;
+    }
+
+    p->probe_cursor = (p->probe_cursor + PROBE_STRIDE) % 256;
+    if (poller_find_meter(p, n) >= 0) {
+      continue;
+    }
+
+    /* A transducer which answers slowly must not hold up the next poll
+       either */
+    probes++;
+    tr_set_timeout(p->t, n, p->probe_timeout);
+    tr_set_deadline(p->t, timer_now_ns() +
+		    (deadline - poller_now(p) - PROBE_OVERHEAD) * 1000000LL);
+    result = tr_identify(p->t, n);
+    tr_set_deadline(p->t, 0);
+    if (TR_OK == result) {
+      tr_set_timeout(p->t, n, 0);
+      publish_message(p, "%d: transducer discovered.\n", n);
+      i = poller_add_meter(p, n, POLLER_DISCOVERED);
+      p->meters[i].identified = 1;
+      publish_forget(p, n);
+    } else {
+      tr_set_timeout(p->t, n, 0);
+    }
+  }
+}
+
+/**
+ * Starts a requested burst. The transducer is identified first unless it
+ * is polled already.
+ */
+static void start_burst(poller *p, long long request)
+{
+  int n = request & 255;
+  int i = poller_find_meter(p, n);
+  int result;
+
+  if (p->burst_address >= 0) {
+    /* Replaces the running one */
+    publish_burst(p, p->burst_address, 1);
+  }
+  p->burst_address = -1;
+
+  if ((i < 0 || !p->meters[i].identified) &&
+      TR_OK != (result = tr_identify(p->t, n))) {
+    publish_message(p, "%d: %s, no burst.\n", n,
+		    (result == TR_LOCK) ? "bus busy" : "unknown transducer model");
+    return;
+  }
+  p->burst_address = n;
+  p->burst_until = poller_now(p) + (request >> 8);
+}
+
+/**
+ * Reads the burst address back to back until deadline or the end of the
+ * burst. Only the instantaneous values are read.
+ */
+static void burst(poller *p, long long deadline)
+{
+  int n = p->burst_address;
+  long long now;
+
+  while (!p->stop && (now = poller_now(p)) < deadline && now < p->burst_until &&
+	 0 == atomic_load(&p->burst_request)) {
+    if (TR_OK == tr_read(p->t, n)) {
+      publish_burst(p, n, 0);
+    }
+  }
+  if (poller_now(p) >= p->burst_until) {
+    publish_burst(p, n, 1);
+    p->burst_address = -1;
+    if (p->burst_exit) {
+      p->stop = 1;
+    }
+  }
+}
+
+/**
+ * Identifies the meters restored from the state file again, in the time
+ * until the next scheduled poll, so that a transducer replaced while the
+ * poller was down is noticed without delaying the first readings.
+ */
+static void revalidate(poller *p, long long deadline)
+{
+  int i;
+
+  for (i = 0; i < p->num_meters && !p->stop; i++) {
+    int n = p->meters[i].address;
+    int type = p->t->transducers[n].type;
+    int max_volts = p->t->transducers[n].max_volts;
+    int max_amps = p->t->transducers[n].max_amps;
+    int result;
+
+    if (!p->meters[i].revalidate) {
+      continue;
+    }
+    if (poller_now(p) + tr_timeout(p->t, n) + PROBE_OVERHEAD > deadline ||
+	TR_LOCK == (result = tr_identify(p->t, n))) {
+      return;
+    }
+    p->meters[i].revalidate = 0;
+    if (result != TR_OK) {
+      publish_message(p, "%d: unknown transducer model.\n", n);
+      poll_failed(p, i);
+    } else if (type != p->t->transducers[n].type ||
+	       max_volts != p->t->transducers[n].max_volts ||
+	       max_amps != p->t->transducers[n].max_amps) {
+      publish_message(p, "%d: transducer model changed.\n", n);
+      publish_forget(p, n);
+    }
+  }
+}
+
+/**
+ * Restores the state of the meters saved by an earlier run, and publishes
+ * their last readings right away. The readings keep their original time
+ * stamps.
+ */
+static void restore(poller *p)
+{
+  int num = state_load(p, p->state);
+  int i;
+
+  if (num < 0) {
+    return;
+  }
+  publish_message(p, "Restored %d meters from `%s'.\n", num, p->state);
+  for (i = 0; i < p->num_meters; i++) {
+    if (p->meters[i].stamp != 0) {
+      publish_reading(p, p->meters[i].address, p->meters[i].stamp, 0);
+    }
+  }
+}
+
+/**
+ * Encodes the state of the meters and hands it to the publisher, which
+ * writes the state file, so that a slow disk does not hold up the bus.
+ */
+static void save(poller *p)
+{
+  uint64_t one = 1;
+  int len;
+
+  /* Skipped while the publisher is still writing the last one */
+  if (0 == atomic_load_explicit(&p->state_len, memory_order_acquire)) {
+    if (0 > (len = state_encode(p, p->state_buf))) {
+      publish_message(p, "Unable to write state file `%s'.\n", p->state);
+    } else {
+      atomic_store_explicit(&p->state_len, len, memory_order_release);
+      write(p->wakeup, &one, sizeof(one));
+    }
+  }
+  p->state_next = poller_now(p) + p->state_interval;
+}
+
+/**
+ * Drops discovered transducers which did not answer for a long time.
+ */
+static void age_out(poller *p, long long now)
+{
+  int i;
+
+  for (i = p->num_meters - 1; i >= 0; i--) {
+    if (p->meters[i].origin == POLLER_DISCOVERED &&
+	now - p->meters[i].last_ok > p->age_out) {
+      publish_message(p, "%d: transducer removed.\n", p->meters[i].address);
+      poller_remove_meter(p, i);
+    }
+  }
+}
+
+/**
+ * Polls all meters, each one once per interval, until p->stop is set.
+ */
+void poller_run(poller *p)
+{
+  if (p->age_out == 0) {
+    p->age_out = 10 * p->interval;
+  }
+
+  if (p->state && NULL == p->state_buf && NULL == (p->state_buf = malloc(STATE_SIZE))) {
+    fprintf(stderr, "Unable to allocate memory.\n");
+    return;
+  }
+  p->bus_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (0 != publisher_start(p)) {
+    fprintf(stderr, "Unable to start the publisher.\n");
+    return;
+  }
+  if (p->state) {
+    restore(p);
+    p->state_next = poller_now(p) + p->state_interval;
+  }
+
+  while (!p->stop && !serial_replay_done(&p->t->ser)) {
+    struct conf *c;
+    long long request;
+    long long now;
+    long long next;
+    int i;
+
+    if (NULL != (c = atomic_exchange(&p->pending, NULL))) {
+      conf_apply_bus(c, p);
+      conf_free(c);
+    }
+
+    if (0 != (request = atomic_exchange(&p->burst_request, 0))) {
+      start_burst(p, request);
+    }
+
+    now = poller_now(p);
+    next = now + p->interval;
+
+    for (i = 0; i < p->num_groups && !p->stop; i++) {
+      if (p->groups[i].next <= now) {
+	poll_group(p, i, now);
+	if (p->burst_address >= 0 && p->groups[i].next < now + p->burst_keepalive) {
+	  p->groups[i].next = now + p->burst_keepalive;
+	}
+      }
+      if (p->groups[i].next < next) {
+	next = p->groups[i].next;
+      }
+    }
+
+    for (i = 0; i < p->num_meters && !p->stop; i++) {
+      /* Members of a group are read with their group, fast ones in
+         between as well */
+      if (p->meters[i].group >= 0 && !p->meters[i].fast) {
+	continue;
+      }
+      if (p->meters[i].next <= now) {
+	poll_meter(p, i, now);
+	/* Only kept alive during a burst, fast meters included */
+	if (p->burst_address >= 0 && p->meters[i].next < now + p->burst_keepalive) {
+	  p->meters[i].next = now + p->burst_keepalive;
+	}
+      }
+      if (p->meters[i].next < next) {
+	next = p->meters[i].next;
+      }
+    }
+
+    if (p->state && !p->stop && poller_now(p) >= p->state_next) {
+      save(p);
+    }
+
+    /* A burst gets all the time until the next poll */
+    if (p->burst_address >= 0 && !p->stop) {
+      burst(p, next);
+      continue;
+    }
+
+    if (p->state && !p->stop) {
+      revalidate(p, next);
+    }
+
+    if (p->discover && !p->stop) {
+      age_out(p, now);
+      discover(p, next);
+      for (i = 0; i < p->num_meters; i++) {
+	if ((p->meters[i].group < 0 || p->meters[i].fast) && p->meters[i].next < next) {
+	  next = p->meters[i].next;
+	}
+      }
+    }
+
+    sleep_ms(p, next - poller_now(p));
+  }
+
+  if (p->burst_address >= 0) {
+    publish_burst(p, p->burst_address, 1);
+    p->burst_address = -1;
+  }
+  publisher_stop(p);
+  /* Written right away, the publisher is gone */
+  if (p->state && 0 != state_write(p->state, p->state_buf, state_encode(p, p->state_buf))) {
+    fprintf(stderr, "Unable to write state file `%s'.\n", p->state);
+  }
+  if (p->bus_wakeup >= 0) {
+    close(p->bus_wakeup);
+    p->bus_wakeup = -1;
+  }
+}
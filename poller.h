@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __POLLER_H
+#define __POLLER_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "transducer.h"
+#include "deadband.h"
+#include "sink.h"
+#include "ring.h"
+#include "alarm.h"
+#include "cache.h"
+
+struct conf;
+
+/* Where a polled meter comes from */
+#define POLLER_CLI 0
+#define POLLER_CONF 1
+#define POLLER_DISCOVERED 2
+
+/* Groups of meters read as one snapshot */
+#define POLLER_GROUPS 16
+#define POLLER_GROUP_NAME 32
+
+/* Virtual meters computed from the meters of a snapshot */
+#define POLLER_VIRTUALS 16
+
+/*
+ * While running, the poller is split in two threads. The bus loop owns
+ * the transducer handle and the meters, and hands samples to the
+ * publisher through a ring. The publisher owns the deadbands, the sinks
+ * and the configuration file.
+ */
+struct poller
+{
+  transducer *t;
+  char *device;
+
+  /* Set (e.g. from a signal handler) to end poller_run() */
+  volatile int stop;
+
+  /* Configuration file, reloaded when it changes or reload is set */
+  char *config;
+  volatile int reload;
+  int config_watch;
+
+  /* Settings before the configuration file was first applied, which
+     keys missing from the file fall back to, see conf_apply() */
+  struct conf *defaults;
+
+  /* Reloaded configuration waiting to be applied by the bus loop, and
+     the eventfd waking the bus loop up for it */
+  _Atomic(struct conf *) pending;
+  int bus_wakeup;
+
+  /* Publisher thread, see publisher.c */
+  ring *ring;
+  int wakeup;
+  pthread_t publisher;
+  atomic_int publisher_stop;
+
+  /* Transducers whose readings the publisher is to forget, and the end
+     of a burst (address + 1, 0 if none), each from the given ring
+     position on. Set by the bus loop instead of passing samples which
+     must not be dropped through the ring, see publish_forget(). */
+  atomic_ullong forget[4];
+  atomic_uint forget_at[256];
+  atomic_int burst_end;
+  atomic_uint burst_end_at;
+
+  atomic_llong clock_offset;
+
+  /* Poll interval in ms */
+  long long interval;
+
+  int num_meters;
+  struct {
+    int address;
+    int origin;
+    int identified;
+
+    /* Group the meter is read with, -1 if it is polled on its own, and
+       the last snapshot it was read in */
+    int group;
+    long long epoch;
+    long long interval;
+    long long next;
+    long long last_ok;
+
+    /* Wall clock time (ns) of the last reading, 0 if none */
+    long long stamp;
+
+    /* Restored from the state file, to be identified again when the bus
+       is idle */
+    int revalidate;
+
+    /* Consecutive failures, and the probe interval once the address
+       is considered dead (0 while healthy) */
+    int failures;
+    long long backoff;
+
+    /* Fast meters are read as often as the bus allows. Their energy is
+       integrated from power and vars in between, and reconciled with
+       the totalizers once per interval. */
+    int fast;
+    long long sampled;
+    long long power[2];
+    long long base[2];
+    long long energy[2];
+    long long rest[2];
+    long long reconcile;
+  } meters[256];
+
+  /*
+   * Groups of meters which are read together, as close to each other as
+   * the bus allows, once per interval. Every such snapshot gets the next
+   * epoch number.
+   */
+  int num_groups;
+  struct {
+    char name[POLLER_GROUP_NAME];
+    int origin;
+    long long interval;
+    long long next;
+    int num_members;
+    unsigned char members[256];
+  } groups[POLLER_GROUPS];
+  long long epoch;
+
+  /*
+   * Virtual meters: sums and differences of meters, computed whenever a
+   * snapshot read all of their members. The masks select the addresses
+   * which are added and subtracted (all bits set), so that a field of
+   * all addresses is summed in one pass without branches.
+   */
+  int num_virtuals;
+  struct {
+    char name[POLLER_GROUP_NAME];
+    int origin;
+    int num_members;
+    unsigned char members[256];
+    long long add[256];
+    long long sub[256];
+  } virtuals[POLLER_VIRTUALS];
+
+  /* Failures until an address is considered dead, maximum probe
+     interval (ms) */
+  int failures_max;
+  long long backoff_max;
+
+  /* Background discovery of new transducers */
+  int discover;
+  int probe_timeout;
+  int probe_cursor;
+  long long age_out;
+
+  /*
+   * A burst reads one address back to back until burst_until (poller
+   * clock), while the other meters are read once per burst_keepalive ms
+   * at most. Other threads request bursts through burst_request, which
+   * holds (length in ms << 8) | address, or 0. burst_exit ends
+   * poller_run() with the burst.
+   */
+  atomic_llong burst_request;
+  int burst_address;
+  long long burst_until;
+  long long burst_keepalive;
+  int burst_exit;
+
+  /* Directory of the burst recordings, and the one being written by the
+     publisher with the number of readings in it (-1 if it could not be
+     created) */
+  char *burst_dir;
+  FILE *burst_file;
+  long burst_count;
+
+  /* FIFO for commands to a running poller, read by the publisher */
+  char *control;
+  int control_fd;
+
+  /* Whether readings are written to the cache of --read, see cache.h,
+     and the cache files, kept open by the publisher */
+  int cache;
+  cache *cache_files;
+
+  /* State file written every state_interval ms and on exit, NULL if
+     none, see state.c */
+  char *state;
+  long long state_interval;
+  long long state_next;
+
+  /* State encoded by the bus loop for the publisher to write, and its
+     length, 0 while there is none */
+  unsigned char *state_buf;
+  atomic_int state_len;
+
+  deadband deadband;
+
+  /* Alarm rules evaluated on every reading, NULL if there are none */
+  alarms *alarms;
+
+  /* Outputs, readings are printed to stdout if there are none */
+  sink *sinks;
+
+  /* Settings of sinks, for those of the configuration file which it
+     does not set */
+  int sink_batch_size;
+  long long sink_batch_age;
+  int sink_buffer;
+  char *spill;
+};
+
+typedef struct poller poller;
+
+poller *poller_alloc(transducer *t);
+void poller_free(poller *p);
+int poller_add_meter(poller *p, int address, int origin);
+int poller_find_meter(poller *p, int address);
+void poller_remove_meter(poller *p, int i);
+int poller_check_group(const char *spec);
+int poller_add_group(poller *p, const char *spec, long long interval, int origin);
+void poller_remove_group(poller *p, int g);
+int poller_check_virtual(const char *spec);
+int poller_add_virtual(poller *p, const char *spec, int origin);
+void poller_remove_virtual(poller *p, int v);
+void poller_add_sink(poller *p, sink *s);
+alarms *poller_alarms(poller *p);
+void poller_reconfigure(poller *p, struct conf *c);
+long long poller_now(poller *p);
+int poller_burst(poller *p, int address, long long length);
+void poller_run(poller *p);
+
+#endif /* __POLLER_H */
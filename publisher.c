@@ -0,0 +1,649 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+
+#include "publisher.h"
+#include "conf.h"
+#include "state.h"
+#include "timer.h"
+
+/* Longest the publisher sleeps without looking at its clock (ms) */
+#define PUBLISHER_TICK 100
+
+/**
+ * Appends to a line of size bytes, len of which are used. Sets len to -1
+ * once the line is too long.
+ */
+static void append(char *line, int size, int *len, const char *format, ...)
+{
+  va_list args;
+  int n;
+
+  if (*len < 0) {
+    return;
+  }
+  va_start(args, format);
+  n = vsnprintf(line + *len, size - *len, format, args);
+  va_end(args);
+  *len = (n < 0 || n >= size - *len) ? -1 : *len + n;
+}
+
+/**
+ * Passes the fields of a reading which left their deadband on to the
+ * sinks, as one line in InfluxDB line protocol, or prints them. Readings
+ * of a snapshot are always passed on in full, with their epoch.
+ */
+static void output(poller *p, sample *s)
+{
+  char line[1024];
+  char meter[RING_NAME];
+  int len = 0;
+  int fields = 0;
+  int field;
+  sink *k;
+
+  if (s->name[0]) {
+    snprintf(meter, sizeof(meter), "%s", s->name);
+  } else {
+    snprintf(meter, sizeof(meter), "%d", s->address);
+  }
+  append(line, sizeof(line), &len, "dstransducer,address=%s ", meter);
+
+  for (field = 0; field < TR_FIELDS; field++) {
+    char text[32];
+
+    if (!(s->fields & (1 << field))) {
+      continue;
+    }
+    if (s->epoch == 0 &&
+	!deadband_check(&p->deadband, s->address, field, s->value[field], s->now)) {
+      continue;
+    }
+    tr_format(text, sizeof(text), field, s->value[field]);
+    if (p->sinks == NULL) {
+      printf("%lld %s %s %s\n", s->stamp / 1000000000LL, meter, tr_field_name(field), text);
+    } else {
+      append(line, sizeof(line), &len, "%s%s=%s",
+	     fields ? "," : "", tr_field_name(field), text);
+    }
+    fields++;
+  }
+
+  if (s->epoch != 0) {
+    if (p->sinks == NULL) {
+      printf("%lld %s epoch %lld\n", s->stamp / 1000000000LL, meter, s->epoch);
+    } else {
+      append(line, sizeof(line), &len, "%sepoch=%lldi",
+	     fields ? "," : "", s->epoch);
+    }
+    fields++;
+  }
+
+  if (p->sinks == NULL) {
+    fflush(stdout);
+  } else if (fields > 0) {
+    append(line, sizeof(line), &len, " %lld\n", s->stamp);
+    if (len < 0) {
+      fprintf(stderr, "%s: line too long, reading dropped.\n", meter);
+      return;
+    }
+    for (k = p->sinks; k != NULL; k = k->next) {
+      sink_push(k, line, len, poller_now(p));
+    }
+  }
+}
+
+/**
+ * Passes the summary of a snapshot on, after the readings which belong
+ * to it.
+ */
+static void output_snapshot(poller *p, sample *s)
+{
+  char line[256];
+  int len = 0;
+  sink *k;
+
+  if (p->sinks == NULL) {
+    printf("%lld %s snapshot %lld %d/%d %.3fms\n", s->stamp / 1000000000LL,
+	   s->snapshot.group, s->epoch, s->snapshot.read, s->snapshot.members,
+	   s->snapshot.skew / 1e6);
+    fflush(stdout);
+    return;
+  }
+  append(line, sizeof(line), &len,
+	 "dssnapshot,group=%s epoch=%lldi,members=%di,read=%di,skew=%.6f %lld\n",
+	 s->snapshot.group, s->epoch, s->snapshot.members, s->snapshot.read,
+	 s->snapshot.skew / 1e9, s->stamp);
+  if (len < 0) {
+    return;
+  }
+  for (k = p->sinks; k != NULL; k = k->next) {
+    sink_push(k, line, len, poller_now(p));
+  }
+}
+
+/**
+ * Closes the recording of the burst of transducer n.
+ */
+static void end_burst(poller *p, int n)
+{
+  if (p->burst_file) {
+    fclose(p->burst_file);
+    fprintf(stderr, "%d: burst ended, %ld readings.\n", n, p->burst_count);
+  }
+  p->burst_file = NULL;
+  p->burst_count = 0;
+}
+
+/**
+ * Writes a reading of a burst to the burst's recording, which is created
+ * with the first one, in InfluxDB line protocol.
+ */
+static void output_burst(poller *p, sample *s)
+{
+  char path[1024];
+  char stamp[32];
+  char text[32];
+  time_t start;
+  struct tm tm;
+  int field;
+
+  if (p->burst_count < 0) {
+    return;
+  }
+  if (p->burst_file == NULL) {
+    start = s->stamp / 1000000000LL;
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&start, &tm));
+    snprintf(path, sizeof(path), "%s/burst-%d-%s.lp",
+	     p->burst_dir ? p->burst_dir : ".", s->address, stamp);
+    if (NULL == (p->burst_file = fopen(path, "w"))) {
+      fprintf(stderr, "Unable to create burst recording `%s'.\n", path);
+      p->burst_count = -1;
+      return;
+    }
+    fprintf(stderr, "%d: burst started, recording to `%s'.\n", s->address, path);
+  }
+
+  fprintf(p->burst_file, "dstransducer,address=%d ", s->address);
+  for (field = 0; field < TR_FIELDS; field++) {
+    if (s->fields & (1 << field)) {
+      tr_format(text, sizeof(text), field, s->value[field]);
+      fprintf(p->burst_file, "%s%s=%s", (s->fields & ((1 << field) - 1)) ? "," : "",
+	      tr_field_name(field), text);
+    }
+  }
+  fprintf(p->burst_file, " %lld\n", s->stamp);
+  p->burst_count++;
+}
+
+/**
+ * Reads commands from the control FIFO, one per line:
+ *
+ *   burst ADDRESS SECONDS
+ */
+static void control(poller *p)
+{
+  char buf[512];
+  char *line, *save;
+  int len;
+
+  if (0 >= (len = read(p->control_fd, buf, sizeof(buf) - 1))) {
+    return;
+  }
+  buf[len] = '\0';
+  for (line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+    int n, seconds;
+
+    if (2 == sscanf(line, "burst %d %d", &n, &seconds) &&
+	0 == poller_burst(p, n, seconds * 1000LL)) {
+      continue;
+    }
+    fprintf(stderr, "Invalid command `%s'.\n", line);
+  }
+}
+
+/**
+ * Passes a burst requested by an alarm on to the bus loop.
+ */
+static void alarm_burst(poller *p)
+{
+  if (p->alarms->burst_length) {
+    poller_burst(p, p->alarms->burst_address, p->alarms->burst_length);
+    p->alarms->burst_length = 0;
+  }
+}
+
+/**
+ * Stores a reading of a transducer in the cache of --read.
+ */
+static void output_cache(poller *p, sample *s)
+{
+  if (p->cache_files == NULL && p->device &&
+      NULL == (p->cache_files = cache_alloc(p->device))) {
+    return;
+  }
+  if (p->cache_files) {
+    cache_store(p->cache_files, s);
+  }
+}
+
+static void handle(poller *p, sample *s)
+{
+  switch (s->kind) {
+  case RING_READING:
+    if (p->alarms && s->name[0] == '\0') {
+      alarm_check(p->alarms, s);
+      alarm_burst(p);
+    }
+    if (p->cache && s->name[0] == '\0' && !p->t->ser.replay) {
+      output_cache(p, s);
+    }
+    output(p, s);
+    break;
+  case RING_MESSAGE:
+    fputs(s->text, stderr);
+    break;
+  case RING_SNAPSHOT:
+    output_snapshot(p, s);
+    break;
+  case RING_BURST:
+    output_burst(p, s);
+    break;
+  }
+}
+
+/**
+ * Forgets the transducers and ends the burst as requested by the bus
+ * loop, once the publisher has got to the position in the ring from which
+ * on the request holds, i.e. before it handles the sample at pos.
+ */
+static void catch_up(poller *p, unsigned pos)
+{
+  int end = atomic_load_explicit(&p->burst_end, memory_order_acquire);
+  int i, n;
+
+  for (i = 0; i < 4; i++) {
+    unsigned long long bits = atomic_load_explicit(&p->forget[i], memory_order_acquire);
+
+    for (n = i * 64; bits; n++, bits >>= 1) {
+      unsigned at;
+
+      if (!(bits & 1)) {
+	continue;
+      }
+      at = atomic_load_explicit(&p->forget_at[n], memory_order_relaxed);
+      if ((int) (pos - at) < 0) {
+	continue;
+      }
+      deadband_forget(&p->deadband, n);
+      atomic_fetch_and(&p->forget[i], ~(1ULL << (n % 64)));
+      /* Forgotten once more in the meantime */
+      if (atomic_load_explicit(&p->forget_at[n], memory_order_relaxed) != at) {
+	atomic_fetch_or(&p->forget[i], 1ULL << (n % 64));
+      }
+    }
+  }
+
+  if (end && (int) (pos - atomic_load_explicit(&p->burst_end_at, memory_order_relaxed)) >= 0 &&
+      atomic_compare_exchange_strong(&p->burst_end, &end, 0)) {
+    end_burst(p, end - 1);
+  }
+}
+
+/**
+ * Hands a sample to the publisher, or handles it right away if the
+ * publisher is not running. Readings are dropped if the ring is almost
+ * full, messages only if it is fuller still, and counted.
+ */
+static void publish(poller *p, sample *s)
+{
+  uint64_t one = 1;
+  int reserve = RING_RESERVE;
+
+  if (p->ring == NULL) {
+    handle(p, s);
+    return;
+  }
+  if (s->kind == RING_MESSAGE) {
+    reserve = RING_RESERVE / 2;
+  }
+  if (0 == ring_push(p->ring, s, reserve)) {
+    write(p->wakeup, &one, sizeof(one));
+  } else {
+    ring_drop(p->ring);
+  }
+}
+
+/**
+ * Flushes all sinks which are due and returns the next flush deadline,
+ * limited to next.
+ */
+static long long flush_sinks(poller *p, long long next, int force)
+{
+  long long now = poller_now(p);
+  sink *s;
+
+  for (s = p->sinks; s != NULL; s = s->next) {
+    long long deadline;
+
+    sink_flush(s, now, force);
+    deadline = sink_deadline(s);
+    if (deadline >= 0 && deadline < next) {
+      next = deadline;
+    }
+  }
+  return next;
+}
+
+/**
+ * Waits up to ms for new samples or a change of the configuration file.
+ */
+static void wait_ms(poller *p, long long ms)
+{
+  fd_set readfds;
+  struct timeval tv;
+  uint64_t events;
+  int max = p->wakeup;
+
+  if (ms <= 0) {
+    return;
+  }
+  FD_ZERO(&readfds);
+  FD_SET(p->wakeup, &readfds);
+  if (p->config_watch >= 0) {
+    FD_SET(p->config_watch, &readfds);
+    if (p->config_watch > max) {
+      max = p->config_watch;
+    }
+  }
+  if (p->control_fd >= 0) {
+    FD_SET(p->control_fd, &readfds);
+    if (p->control_fd > max) {
+      max = p->control_fd;
+    }
+  }
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  if (select(max + 1, &readfds, NULL, NULL, &tv) > 0) {
+    if (FD_ISSET(p->wakeup, &readfds)) {
+      read(p->wakeup, &events, sizeof(events));
+    }
+    if (p->control_fd >= 0 && FD_ISSET(p->control_fd, &readfds)) {
+      control(p);
+    }
+  }
+}
+
+static void *publisher(void *arg)
+{
+  poller *p = arg;
+  long dropped = 0;
+  unsigned pos = 0;
+  sample s;
+  int len;
+
+  for (;;) {
+    int stopping = atomic_load(&p->publisher_stop);
+    long long now;
+
+    while (0 == ring_pop(p->ring, &s)) {
+      catch_up(p, pos++);
+      handle(p, &s);
+    }
+    catch_up(p, pos);
+    if (ring_dropped(p->ring) != dropped) {
+      fprintf(stderr, "%ld samples dropped, the publisher is too slow.\n",
+	      ring_dropped(p->ring) - dropped);
+      dropped = ring_dropped(p->ring);
+    }
+    if (stopping) {
+      break;
+    }
+
+    if (p->config && (p->reload || conf_changed(p->config_watch, p->config))) {
+      p->reload = 0;
+      if (0 != conf_reload(p)) {
+	fprintf(stderr, "Configuration `%s' not reloaded.\n", p->config);
+      }
+    }
+
+    if (0 < (len = atomic_load_explicit(&p->state_len, memory_order_acquire))) {
+      if (0 != state_write(p->state, p->state_buf, len)) {
+	fprintf(stderr, "Unable to write state file `%s'.\n", p->state);
+      }
+      atomic_store_explicit(&p->state_len, 0, memory_order_release);
+    }
+
+    now = poller_now(p);
+    if (p->alarms) {
+      alarm_tick(p->alarms, now);
+      alarm_burst(p);
+    }
+    wait_ms(p, flush_sinks(p, now + PUBLISHER_TICK, 0) - now);
+  }
+
+  flush_sinks(p, 0, 1);
+  return NULL;
+}
+
+/**
+ * Starts the publisher thread. Signals stay with the bus loop, so that
+ * they interrupt its sleep.
+ */
+int publisher_start(poller *p)
+{
+  sigset_t all, old;
+
+  if (NULL == (p->ring = ring_alloc(PUBLISHER_RING))) {
+    return -1;
+  }
+  if (0 > (p->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+    ring_free(p->ring);
+    p->ring = NULL;
+    return -1;
+  }
+  atomic_store(&p->publisher_stop, 0);
+
+  if (p->control) {
+    /* Opened for writing as well, so that it does not hit end of file
+       whenever a writer goes away */
+    if ((mkfifo(p->control, 0600) < 0 && errno != EEXIST) ||
+	0 > (p->control_fd = open(p->control, O_RDWR | O_NONBLOCK | O_CLOEXEC))) {
+      fprintf(stderr, "Unable to open control FIFO `%s'.\n", p->control);
+    }
+  }
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (0 != pthread_create(&p->publisher, NULL, publisher, p)) {
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    close(p->wakeup);
+    ring_free(p->ring);
+    p->ring = NULL;
+    return -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return 0;
+}
+
+/**
+ * Lets the publisher handle all pending samples, flush the sinks and
+ * end.
+ */
+void publisher_stop(poller *p)
+{
+  uint64_t one = 1;
+
+  if (p->ring == NULL) {
+    return;
+  }
+  atomic_store(&p->publisher_stop, 1);
+  write(p->wakeup, &one, sizeof(one));
+  pthread_join(p->publisher, NULL);
+
+  close(p->wakeup);
+  p->wakeup = -1;
+  ring_free(p->ring);
+  p->ring = NULL;
+  if (p->control_fd >= 0) {
+    close(p->control_fd);
+    p->control_fd = -1;
+  }
+}
+
+/**
+ * Publishes the current reading of transducer n, taken at stamp (wall
+ * clock, ns, 0 for now) as part of snapshot epoch (0 for none).
+ */
+void publish_reading(poller *p, int n, long long stamp, long long epoch)
+{
+  sample s;
+  int field;
+
+  s.kind = RING_READING;
+  s.address = n;
+  s.name[0] = '\0';
+  s.fields = 0;
+  s.now = poller_now(p);
+  s.stamp = stamp ? stamp : timer_wall_ns();
+  s.epoch = epoch;
+  s.type = p->t->transducers[n].type;
+  s.max_volts = p->t->transducers[n].max_volts;
+  s.max_amps = p->t->transducers[n].max_amps;
+  s.ct = p->t->transducers[n].ct;
+  s.pt = p->t->transducers[n].pt;
+  for (field = 0; field < TR_FIELDS; field++) {
+    if (tr_has_field(p->t, n, field)) {
+      s.fields |= 1 << field;
+      s.value[field] = tr_value(p->t, n, field);
+    }
+  }
+  publish(p, &s);
+}
+
+/**
+ * Publishes the instantaneous values of transducer n as a reading of a
+ * burst, or the end of the burst. The end is not passed through the ring,
+ * where it might be dropped, but flagged for the publisher.
+ */
+void publish_burst(poller *p, int n, int end)
+{
+  uint64_t one = 1;
+  sample s;
+  int field;
+
+  if (end && p->ring == NULL) {
+    end_burst(p, n);
+    return;
+  } else if (end) {
+    atomic_store_explicit(&p->burst_end_at, ring_head(p->ring), memory_order_relaxed);
+    atomic_store_explicit(&p->burst_end, n + 1, memory_order_release);
+    write(p->wakeup, &one, sizeof(one));
+    return;
+  }
+
+  s.kind = RING_BURST;
+  s.address = n;
+  s.name[0] = '\0';
+  s.fields = 0;
+  s.now = poller_now(p);
+  s.stamp = timer_wall_ns();
+  s.epoch = 0;
+  for (field = 0; field < TR_FIELDS; field++) {
+    if (field != TR_KWHR && field != TR_KVARHR && tr_has_field(p->t, n, field)) {
+      s.fields |= 1 << field;
+      s.value[field] = tr_value(p->t, n, field);
+    }
+  }
+  publish(p, &s);
+}
+
+/**
+ * Publishes the values of a virtual meter, computed from snapshot epoch.
+ */
+void publish_virtual(poller *p, const char *name, int fields, const long long *value,
+		     long long stamp, long long epoch)
+{
+  sample s;
+
+  s.kind = RING_READING;
+  s.address = -1;
+  snprintf(s.name, sizeof(s.name), "%s", name);
+  s.fields = fields;
+  s.now = poller_now(p);
+  s.stamp = stamp;
+  s.epoch = epoch;
+  memcpy(s.value, value, sizeof(s.value));
+  publish(p, &s);
+}
+
+/**
+ * Publishes the summary of snapshot epoch of a group: how many of its
+ * members were read, and the time between the first and the last
+ * reading (ns).
+ */
+void publish_snapshot(poller *p, const char *group, long long epoch, int members,
+		      int read, long long skew)
+{
+  sample s;
+
+  s.kind = RING_SNAPSHOT;
+  s.address = -1;
+  s.now = poller_now(p);
+  s.stamp = timer_wall_ns();
+  s.epoch = epoch;
+  snprintf(s.snapshot.group, sizeof(s.snapshot.group), "%s", group);
+  s.snapshot.members = members;
+  s.snapshot.read = read;
+  s.snapshot.skew = skew;
+  publish(p, &s);
+}
+
+/**
+ * Prints a message on stderr, from the publisher thread.
+ */
+void publish_message(poller *p, const char *format, ...)
+{
+  va_list args;
+  sample s;
+
+  s.kind = RING_MESSAGE;
+  va_start(args, format);
+  vsnprintf(s.text, sizeof(s.text), format, args);
+  va_end(args);
+  publish(p, &s);
+}
+
+/**
+ * Makes the publisher forget the readings of transducer n, so that the
+ * next one is passed on in full. The request is not passed through the
+ * ring, where it might be dropped, but flagged for the publisher, which
+ * carries it out before the samples published after it.
+ */
+void publish_forget(poller *p, int n)
+{
+  uint64_t one = 1;
+
+  if (p->ring == NULL) {
+    deadband_forget(&p->deadband, n);
+    return;
+  }
+  atomic_store_explicit(&p->forget_at[n], ring_head(p->ring), memory_order_relaxed);
+  atomic_fetch_or_explicit(&p->forget[n / 64], 1ULL << (n % 64), memory_order_release);
+  write(p->wakeup, &one, sizeof(one));
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __PUBLISHER_H
+#define __PUBLISHER_H
+
+#include "poller.h"
+
+/* Samples the bus may get ahead of the publisher */
+#ifdef HEAPFREE
+#define PUBLISHER_RING 64
+#else
+#define PUBLISHER_RING 4096
+#endif
+
+int publisher_start(poller *p);
+void publisher_stop(poller *p);
+void publish_reading(poller *p, int n, long long stamp, long long epoch);
+void publish_virtual(poller *p, const char *name, int fields, const long long *value,
+		     long long stamp, long long epoch);
+void publish_snapshot(poller *p, const char *group, long long epoch, int members,
+		      int read, long long skew);
+void publish_burst(poller *p, int n, int end);
+void publish_message(poller *p, const char *format, ...);
+void publish_forget(poller *p, int n);
+
+#endif /* __PUBLISHER_H */
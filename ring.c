@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdlib.h>
+
+#include "ring.h"
+
+/**
+ * Allocates a ring for at least size samples. The size is rounded up to
+ * a power of two.
+ */
+ring *ring_alloc(int size)
+{
+  ring *r;
+  int n = 1;
+
+  while (n < size) {
+    n <<= 1;
+  }
+  if (NULL == (r = malloc(sizeof(ring)))) {
+    return NULL;
+  }
+  if (NULL == (r->samples = malloc(n * sizeof(sample)))) {
+    free(r);
+    return NULL;
+  }
+  r->size = n;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  atomic_init(&r->dropped, 0);
+  return r;
+}
+
+void ring_free(ring *r)
+{
+  if (r) {
+    free(r->samples);
+    free(r);
+  }
+}
+
+/**
+ * Appends a sample, if that leaves at least reserve slots free. Returns
+ * -1 otherwise. Producer side only.
+ */
+int ring_push(ring *r, const sample *s, int reserve)
+{
+  unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+  if (head - tail + reserve >= (unsigned) r->size) {
+    return -1;
+  }
+  r->samples[head & (r->size - 1)] = *s;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  return 0;
+}
+
+/**
+ * Removes the oldest sample. Returns -1 if the ring is empty. Consumer
+ * side only.
+ */
+int ring_pop(ring *r, sample *s)
+{
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+  if (head == tail) {
+    return -1;
+  }
+  *s = r->samples[tail & (r->size - 1)];
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return 0;
+}
+
+/**
+ * Returns the position of the next sample to be pushed, i.e. the number
+ * of samples pushed so far. Producer side only.
+ */
+unsigned ring_head(ring *r)
+{
+  return atomic_load_explicit(&r->head, memory_order_relaxed);
+}
+
+/**
+ * Counts a sample which was rejected. Producer side only.
+ */
+void ring_drop(ring *r)
+{
+  atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+}
+
+/**
+ * Returns the number of samples rejected so far.
+ */
+long ring_dropped(ring *r)
+{
+  return atomic_load_explicit(&r->dropped, memory_order_relaxed);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __RING_H
+#define __RING_H
+
+#include <stdatomic.h>
+
+#include "transducer.h"
+
+/* Kinds of samples */
+#define RING_READING 0
+#define RING_MESSAGE 1
+#define RING_SNAPSHOT 2
+#define RING_BURST 3
+
+#define RING_NAME 32
+
+/* Slots which readings leave free for messages, see publish() */
+#define RING_RESERVE 8
+
+/*
+ * A sample handed from the bus to the publisher: a reading, a message for
+ * stderr, the summary of a snapshot of a group, or a reading of a burst.
+ */
+struct sample
+{
+  int kind;
+  int address;
+
+  /* Name of a virtual meter, empty for transducers */
+  char name[RING_NAME];
+
+  /* Bit mask of the fields present in value */
+  int fields;
+
+  /* Poller clock (ms) and wall clock (ns) of the reading */
+  long long now;
+  long long stamp;
+
+  /* Snapshot the reading belongs to, 0 if none */
+  long long epoch;
+
+  /* Model and transformer ratios of the transducer read, for the cache */
+  int type;
+  int max_volts;
+  int max_amps;
+  double ct;
+  double pt;
+
+  union {
+    long long value[TR_FIELDS];
+    char text[TR_FIELDS * sizeof(long long)];
+    struct {
+      char group[32];
+      int members;
+      int read;
+      /* Time between the first and the last reading (ns) */
+      long long skew;
+    } snapshot;
+  };
+};
+
+typedef struct sample sample;
+
+/*
+ * Single producer, single consumer queue of samples. Neither side ever
+ * waits for the other: a full ring rejects new samples, which the
+ * producer counts. A sample may be pushed only if it leaves a given
+ * number of slots free, so that less important samples cannot crowd out
+ * the others.
+ */
+struct ring
+{
+  int size;
+  sample *samples;
+
+  /* Written by the producer only */
+  _Alignas(64) atomic_uint head;
+  atomic_long dropped;
+
+  /* Written by the consumer only */
+  _Alignas(64) atomic_uint tail;
+};
+
+typedef struct ring ring;
+
+ring *ring_alloc(int size);
+void ring_free(ring *r);
+int ring_push(ring *r, const sample *s, int reserve);
+int ring_pop(ring *r, sample *s);
+unsigned ring_head(ring *r);
+void ring_drop(ring *r);
+long ring_dropped(ring *r);
+
+#endif /* __RING_H */
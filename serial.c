@@ -3,20 +3,237 @@
  */
 
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 
 #include "debug.h"
 #include "serial.h"
+#include "timer.h"
 
-int serial_write(int fd, string *s)
+void serial_init(serial *s, int fd)
 {
-  return serial_writeb(fd, (char *) str_getbuf(s));
+  s->fd = fd;
+  s->capture = NULL;
+  s->replay = 0;
+  s->replay_data = NULL;
+  s->write_time = 0;
+  s->first_byte = 0;
+  s->bytes_written = 0;
+  s->bytes_read = 0;
+  s->deadline = 0;
 }
 
-int serial_writeb(int fd, char *buf)
+static void put_le(unsigned char *b, unsigned long long v, int bytes)
+{
+  int i;
+  for (i = 0; i < bytes; i++) {
+    b[i] = (v >> (8 * i)) & 0xff;
+  }
+}
+
+static unsigned long long get_le(const unsigned char *b, int bytes)
+{
+  unsigned long long v = 0;
+  int i;
+  for (i = bytes - 1; i >= 0; i--) {
+    v = (v << 8) | b[i];
+  }
+  return v;
+}
+
+/**
+ * Starts recording all traffic into a capture file.
+ */
+int serial_capture(serial *s, const char *file)
+{
+  unsigned char header[SER_CAPTURE_HEADER];
+  struct timespec ts;
+
+  if (NULL == (s->capture = fopen(file, "wb"))) {
+    return SER_ERROR;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  memcpy(header, SER_CAPTURE_MAGIC, 8);
+  put_le(header + 8, (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec, 8);
+  s->capture_start = timer_now_ns();
+
+  if (1 != fwrite(header, sizeof(header), 1, s->capture)) {
+    fclose(s->capture);
+    s->capture = NULL;
+    return SER_ERROR;
+  }
+  return SER_OK;
+}
+
+static void record(serial *s, int dir, const char *buf, int len)
+{
+  unsigned char header[SER_CAPTURE_RECORD];
+
+  put_le(header, timer_now_ns() - s->capture_start, 8);
+  header[8] = dir;
+  put_le(header + 9, len, 2);
+  fwrite(header, sizeof(header), 1, s->capture);
+  fwrite(buf, len, 1, s->capture);
+}
+
+/**
+ * Replaces the serial device by a capture file. Written data is
+ * discarded, reads return the recorded replies, either with their
+ * original timing or as fast as possible.
+ */
+int serial_replay(serial *s, const char *file, int speed)
+{
+  struct stat st;
+  void *data;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) < 0) {
+    return SER_ERROR;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < SER_CAPTURE_HEADER) {
+    close(fd);
+    return SER_ERROR;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return SER_ERROR;
+  }
+  if (0 != memcmp(data, SER_CAPTURE_MAGIC, 8)) {
+    munmap(data, st.st_size);
+    return SER_ERROR;
+  }
+
+  s->fd = -1;
+  s->replay = 1;
+  s->replay_speed = speed;
+  s->replay_data = data;
+  s->replay_size = st.st_size;
+  s->replay_pos = SER_CAPTURE_HEADER;
+  s->replay_offset = 0;
+  s->replay_start = timer_now_ns();
+  return SER_OK;
+}
+
+void serial_close(serial *s)
+{
+  if (s->capture) {
+    fclose(s->capture);
+    s->capture = NULL;
+  }
+  if (s->replay_data) {
+    munmap((void *) s->replay_data, s->replay_size);
+    s->replay_data = NULL;
+  }
+  s->replay = 0;
+}
+
+/**
+ * Returns the direction of the current replay record, or 0 at the end of
+ * the capture.
+ */
+static int replay_record(serial *s, long long *ts, int *len)
+{
+  const unsigned char *r = s->replay_data + s->replay_pos;
+
+  if (s->replay_pos + SER_CAPTURE_RECORD > s->replay_size) {
+    return 0;
+  }
+  *ts = get_le(r, 8);
+  *len = get_le(r + 9, 2);
+  if (s->replay_pos + SER_CAPTURE_RECORD + *len > s->replay_size) {
+    return 0;
+  }
+  return r[8];
+}
+
+static void replay_next(serial *s, int len)
+{
+  s->replay_pos += SER_CAPTURE_RECORD + len;
+  s->replay_offset = 0;
+}
+
+/**
+ * Returns true if a replay reached the end of its capture file.
+ */
+int serial_replay_done(serial *s)
+{
+  long long ts;
+  int len;
+
+  return s->replay && 0 == replay_record(s, &ts, &len);
+}
+
+static int replay_write(serial *s, const char *buf, int len)
+{
+  long long ts;
+  int rlen;
+  int dir;
+
+  /* Replies which were not consumed are dropped. */
+  while (SER_DIR_READ == (dir = replay_record(s, &ts, &rlen))) {
+    replay_next(s, rlen);
+  }
+
+  if (dir == SER_DIR_WRITE) {
+#ifdef DEBUG
+    if (rlen != len ||
+	0 != memcmp(s->replay_data + s->replay_pos + SER_CAPTURE_RECORD, buf, len)) {
+      printf("serial_write: replay diverges from capture\n");
+    }
+#endif
+    replay_next(s, rlen);
+  }
+  return len;
+}
+
+static int replay_read(serial *s, char *buf, int n, int timeout)
+{
+  long long ts;
+  int len;
+
+  if (SER_DIR_READ != replay_record(s, &ts, &len)) {
+    /* Nothing was received at this point of the capture. */
+    if (s->replay_speed == SER_REPLAY_ORIGINAL) {
+      timer_sleep_ms(timeout);
+    }
+    return SER_TIMEOUT;
+  }
+
+  if (s->replay_speed == SER_REPLAY_ORIGINAL && s->replay_offset == 0) {
+    long long wait = (s->replay_start + ts - timer_now_ns()) / 1000000LL;
+    if (wait > timeout) {
+      timer_sleep_ms(timeout);
+      return SER_TIMEOUT;
+    }
+    timer_sleep_ms(wait);
+  }
+
+  if (n > len - s->replay_offset) {
+    n = len - s->replay_offset;
+  }
+  memcpy(buf, s->replay_data + s->replay_pos + SER_CAPTURE_RECORD + s->replay_offset, n);
+  s->replay_offset += n;
+  if (s->replay_offset == len) {
+    replay_next(s, len);
+  }
+  return n;
+}
+
+int serial_write(serial *s, string *str)
+{
+  return serial_writeb(s, (char *) str_getbuf(str));
+}
+
+int serial_writeb(serial *s, char *buf)
 {
   int w;
 
@@ -28,99 +245,201 @@ int serial_writeb(int fd, char *buf)
   }
   printf("\n");
 #endif
-  
-  w = write(fd, buf, strlen(buf));
+
+  s->write_time = timer_now_ns();
+  s->first_byte = 0;
+  s->bytes_read = 0;
+  s->bytes_written = strlen(buf);
+
+  if (s->replay) {
+    return replay_write(s, buf, strlen(buf));
+  }
+
+  w = write(s->fd, buf, strlen(buf));
+  if (w > 0 && s->capture) {
+    record(s, SER_DIR_WRITE, buf, w);
+  }
   return w;
 }
 
-int readline(int fd, string *s, char *breakchars, int chars_max)
+/**
+ * Updates the timing of the current exchange with n received bytes.
+ */
+static void received(serial *s, int n)
 {
-  static char ibuf[80];
-  int chars_read = 0;
+  if (s->first_byte == 0) {
+    s->first_byte = timer_now_ns();
+  }
+  s->bytes_read += n;
+}
 
-  while (1) {
-    fd_set readfds;
-    struct timeval time;
-    int rc;
+/**
+ * Waits up to timeout ms for data and reads what is available.
+ */
+static int serial_read(serial *s, char *buf, int n, int timeout)
+{
+  fd_set readfds;
+  struct timeval time;
+  int rc;
 
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
+  if (s->replay) {
+    rc = replay_read(s, buf, n, timeout);
+    if (rc > 0) {
+      received(s, rc);
+    }
+    return rc;
+  }
 
-    /* Wait for input */   
-    time.tv_sec = 1;
-    time.tv_usec = 0;
-    rc = select(fd+1, &readfds, NULL, NULL, &time);
+  /* Wait for input */   
+  time.tv_sec = timeout / 1000;
+  time.tv_usec = (timeout % 1000) * 1000;
+  do {
+    /* Linux leaves the remaining time in time when interrupted */
+    FD_ZERO(&readfds);
+    FD_SET(s->fd, &readfds);
+    rc = select(s->fd+1, &readfds, NULL, NULL, &time);
+  } while (rc < 0 && errno == EINTR);
 
 #ifdef DEBUG
-    printf("select returned %d\n", rc);
+  printf("select returned %d\n", rc);
 #endif
 
-    if (rc < 0) {
+  if (rc < 0) {
+    return SER_ERROR;
+  } else if (rc == 0 || !FD_ISSET(s->fd, &readfds)) {
+    return SER_TIMEOUT;
+  }
 
-      return SER_ERROR;
+  rc = read(s->fd, buf, n);
 
-    } else if (rc == 0) {
+#ifdef DEBUG
+  printf("serial_readline: read %d characters\n", rc);
+#endif
 
-      return SER_TIMEOUT;
+  if (rc <= 0) {
+    return SER_ERROR;
+  }
+  received(s, rc);
+  if (s->capture) {
+    record(s, SER_DIR_READ, buf, rc);
+  }
+  return rc;
+}
+
+/**
+ * Appends the n characters in buf to str, up to a break character or
+ * until chars_max characters were read. Returns SER_OK when the line is
+ * complete and SER_AGAIN if more characters are needed.
+ */
+static int collect(string *str, const char *buf, int n, char *breakchars,
+		   int chars_max, int *chars_read)
+{
+  int i;
 
-    } else {
+  for (i = 0; i < n; i++) {
+    int c = buf[i];
 
-      if (FD_ISSET(fd, &readfds)) {
+    if (breakchars != NULL) {
+      /* Check if a break character occurred */
+      int j;
+      for (j = 0; j < strlen(breakchars); j++) {
+	if (c == breakchars[j]) {
+	  return SER_OK;
+	}
+      }
+    }
 
-	int rrc = read(fd, ibuf, sizeof(ibuf));
+    if (c != 0) {
+      if (0 != str_appendc(str, c)) {
+	return SER_ERROR;
+      }
+      (*chars_read)++;
 
 #ifdef DEBUG
-	printf("serial_readline: read %d characters\n", rrc);
+      printf("serial_readline: current line='%s'\n", str_getbuf(str));
 #endif
-	
-	if (rrc > 0) {
-
-	  int i;
-	  for (i = 0; i < rrc; i++) {
-	    int c = ibuf[i];
-
-	    if (breakchars != NULL) {
-	      /* Check if a break character occurred */
-	      int j;
-	      for (j = 0; j < strlen(breakchars); j++) {
-		if (c == breakchars[j]) {
-		  return SER_OK;
-		}
-	      }
-	    }
-
-	    if (c != 0) {
-	      str_appendc(s, c);
-	      chars_read++;
 
-#ifdef DEBUG
-	      printf("serial_readline: current line='%s'\n", str_getbuf(s));
-#endif
+      if (chars_max > 0 && *chars_read == chars_max) {
+	return SER_OK;
+      } 
+    }
+  }
+  return SER_AGAIN;
+}
 
-	      if (chars_max > 0 && chars_read == chars_max) {
-		return SER_OK;
-	      } 
-/* 	    } else { */
-/* 	      printf("serial_readline: read character 0\n"); */
-	    }
-	  }
-	  
-	} else {
-
-	  return SER_ERROR;
-	  
-	}
+static int readline(serial *s, string *str, char *breakchars, int chars_max, int timeout)
+{
+  char ibuf[80];
+  int chars_read = 0;
+
+  while (1) {
+    int wait = timeout;
+    int rc;
+
+    if (s->deadline != 0 && !s->replay) {
+      long long left = s->deadline - timer_now_ns();
+
+      if (left <= 0) {
+	return SER_TIMEOUT;
       }
+      if (left < wait * 1000000LL) {
+	wait = (left + 999999) / 1000000;
+      }
+    }
+    rc = serial_read(s, ibuf, sizeof(ibuf), wait);
+    if (rc < 0) {
+      return rc;
+    }
+    rc = collect(str, ibuf, rc, breakchars, chars_max, &chars_read);
+    if (rc != SER_AGAIN) {
+      return rc;
     }
   }
 }
 
-int serial_readchars(int fd, string *s, int chars_max)
+int serial_readchars(serial *s, string *str, int chars_max, int timeout)
 {
-  return readline(fd, s, NULL, chars_max);
+  return readline(s, str, NULL, chars_max, timeout);
 }
 
-int serial_readline(int fd, string *s)
+int serial_readline(serial *s, string *str, int timeout)
 {
-  return readline(fd, s, "\r\n", 0);
+  return readline(s, str, "\r\n", 0, timeout);
+}
+
+/**
+ * Reads what is available without waiting and appends it to the line in
+ * str. Returns SER_OK when the line is complete and SER_AGAIN if the rest
+ * has not arrived yet, in which case str keeps the partial line for the
+ * next call. Not available when replaying.
+ */
+int serial_readline_nb(serial *s, string *str)
+{
+  char ibuf[80];
+  int chars_read = 0;
+  int rc;
+
+  if (s->replay) {
+    return SER_ERROR;
+  }
+
+  while (1) {
+    rc = read(s->fd, ibuf, sizeof(ibuf));
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    } else if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      return SER_ERROR;
+    } else if (rc <= 0) {
+      /* Nothing more for now */
+      return SER_AGAIN;
+    }
+    received(s, rc);
+    if (s->capture) {
+      record(s, SER_DIR_READ, ibuf, rc);
+    }
+    rc = collect(str, ibuf, rc, "\r\n", 0, &chars_read);
+    if (rc != SER_AGAIN) {
+      return rc;
+    }
+  }
 }
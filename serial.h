@@ -21,15 +21,81 @@
 #ifndef __SERIAL_H
 #define __SERIAL_H
 
+#include <stdio.h>
+
 #include "string.h"
 
 #define SER_OK 0
 #define SER_ERROR -1
 #define SER_TIMEOUT -2
+#define SER_AGAIN -3
+
+/* Default time to wait for a character, in ms */
+#define SER_TIMEOUT_DEFAULT 1000
+
+/* Replay speeds */
+#define SER_REPLAY_ORIGINAL 0
+#define SER_REPLAY_MAX 1
+
+/*
+ * Capture files start with a header of 16 bytes: the magic below and
+ * the wall clock time of the capture start (ns since the epoch). Every
+ * chunk of data written or read follows as a record of 11 bytes and the
+ * data itself:
+ *
+ *   8 bytes  monotonic time since capture start (ns)
+ *   1 byte   direction, SER_DIR_WRITE or SER_DIR_READ
+ *   2 bytes  length of the data
+ *
+ * All numbers are little endian.
+ */
+#define SER_CAPTURE_MAGIC "DSCAP001"
+#define SER_CAPTURE_HEADER 16
+#define SER_CAPTURE_RECORD 11
+#define SER_DIR_WRITE 'W'
+#define SER_DIR_READ 'R'
+
+struct serial
+{
+  int fd;
+
+  /* Capture of all traffic, NULL if not capturing */
+  FILE *capture;
+  long long capture_start;
+
+  /* Replay of a capture file */
+  int replay;
+  int replay_speed;
+  const unsigned char *replay_data;
+  long replay_size;
+  long replay_pos;
+  int replay_offset;
+  long long replay_start;
+
+  /* Timing of the last exchange: monotonic time (ns) of the last write
+     and of the first byte read after it (0 if none yet), and the number
+     of bytes written and read */
+  long long write_time;
+  long long first_byte;
+  int bytes_written;
+  int bytes_read;
+
+  /* Monotonic time (ns) at which reads time out however much arrived
+     before, 0 if none. Ignored when replaying. */
+  long long deadline;
+};
+
+typedef struct serial serial;
 
-int serial_write(int fd, string *s);
-int serial_writeb(int fd, char *b);
-int serial_readline(int fd, string *s);
-int serial_readchars(int fd, string *s, int n);
+void serial_init(serial *s, int fd);
+int serial_capture(serial *s, const char *file);
+int serial_replay(serial *s, const char *file, int speed);
+int serial_replay_done(serial *s);
+void serial_close(serial *s);
+int serial_write(serial *s, string *str);
+int serial_writeb(serial *s, char *b);
+int serial_readline(serial *s, string *str, int timeout);
+int serial_readchars(serial *s, string *str, int n, int timeout);
+int serial_readline_nb(serial *s, string *str);
 
 #endif /* __SERIAL_H */
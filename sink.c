@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sink.h"
+
+static int open_udp(const char *target)
+{
+  struct addrinfo hints;
+  struct addrinfo *ai;
+  char host[256];
+  const char *port;
+  int fd;
+
+  if (NULL == (port = strrchr(target, ':')) || port - target >= sizeof(host)) {
+    return -1;
+  }
+  memcpy(host, target, port - target);
+  host[port - target] = '\0';
+  port++;
+
+  /* Only numeric addresses, a name lookup could block */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  if (0 != getaddrinfo(host, port, &hints, &ai)) {
+    return -1;
+  }
+
+  fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(ai);
+  return fd;
+}
+
+static int open_unix(const char *target)
+{
+  struct sockaddr_un sun;
+  int fd;
+
+  if (strlen(target) >= sizeof(sun.sun_path)) {
+    return -1;
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, target);
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+/**
+ * Opens the sink's target. Failures are not fatal, opening is retried on
+ * the next flush (e.g. until a reader opens the FIFO).
+ */
+static void sink_open(sink *s)
+{
+  switch (s->type) {
+  case SINK_FILE:
+    s->fd = open(s->target, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
+    break;
+  case SINK_FIFO:
+    s->fd = open(s->target, O_WRONLY | O_NONBLOCK);
+    break;
+  case SINK_UDP:
+    s->fd = open_udp(s->target);
+    break;
+  case SINK_UNIX:
+    s->fd = open_unix(s->target);
+    break;
+  }
+}
+
+static void sink_close(sink *s)
+{
+  if (s->fd >= 0) {
+    close(s->fd);
+    s->fd = -1;
+  }
+}
+
+/**
+ * Creates a sink from a specification "type:target", where type is one
+ * of file, fifo, udp (target host:port) or unix (target socket path).
+ */
+sink *sink_alloc(const char *spec, int size, const char *spill_dir)
+{
+  static const char *types[] = { "file:", "fifo:", "udp:", "unix:" };
+  sink *s;
+  int i;
+
+  if (NULL == (s = malloc(sizeof(sink)))) {
+    return NULL;
+  }
+  memset(s, 0, sizeof(sink));
+  s->type = -1;
+  s->fd = -1;
+  s->spill = -1;
+  s->batch_size = SINK_BATCH_SIZE;
+  s->batch_age = SINK_BATCH_AGE;
+
+  for (i = 0; i < 4; i++) {
+    if (0 == strncmp(spec, types[i], strlen(types[i]))) {
+      s->type = i;
+      s->target = strdup(spec + strlen(types[i]));
+    }
+  }
+  s->spec = strdup(spec);
+  s->size = size;
+  s->buf = malloc(size);
+  if (s->type < 0 || s->spec == NULL || s->target == NULL || s->buf == NULL) {
+    sink_free(s);
+    return NULL;
+  }
+
+  if (spill_dir != NULL) {
+    char path[1024];
+    char *c;
+
+    snprintf(path, sizeof(path), "%s/%s.spill", spill_dir, spec);
+    for (c = path + strlen(spill_dir) + 1; *c; c++) {
+      if (*c == '/' || *c == ':') {
+	*c = '_';
+      }
+    }
+    /* Readings spilled by a previous run are sent first. */
+    if ((s->spill = open(path, O_RDWR | O_CREAT | O_APPEND, 0600)) < 0) {
+      sink_free(s);
+      return NULL;
+    }
+    s->spill_end = lseek(s->spill, 0, SEEK_END);
+  }
+
+  return s;
+}
+
+void sink_free(sink *s)
+{
+  sink_close(s);
+  if (s->spill >= 0) {
+    close(s->spill);
+  }
+  free(s->spec);
+  free(s->target);
+  free(s->buf);
+  free(s);
+}
+
+/**
+ * Queues one line. Returns 0 if queued or spilled, -1 if dropped.
+ */
+int sink_push(sink *s, const char *line, int len, long long now)
+{
+  if (s->spill_end == s->spill_pos && s->len + len <= s->size) {
+    memcpy(s->buf + s->len, line, len);
+    s->len += len;
+    if (s->lines++ == 0) {
+      s->oldest = now;
+    }
+    return 0;
+  }
+
+  /* The buffer is full, or older readings are waiting in the spill
+     file already. */
+  if (s->spill >= 0 && len == write(s->spill, line, len)) {
+    s->spill_end += len;
+    return 0;
+  }
+
+  s->dropped++;
+  return -1;
+}
+
+static int count_lines(const char *buf, int len)
+{
+  int lines = 0;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (buf[i] == '\n') {
+      lines++;
+    }
+  }
+  return lines;
+}
+
+/**
+ * Writes as much of the buffer as possible without blocking and returns
+ * the number of bytes written.
+ */
+static int write_out(sink *s)
+{
+  int done = 0;
+
+  if (s->type == SINK_FILE || s->type == SINK_FIFO) {
+    int w = write(s->fd, s->buf, s->len);
+    if (w > 0) {
+      done = w;
+    } else if (w < 0 && errno != EAGAIN) {
+      sink_close(s);
+    }
+  } else {
+    while (done < s->len) {
+      int n = 0;
+      int w;
+
+      /* Fill a datagram with complete lines */
+      while (done + n < s->len) {
+	char *nl = memchr(s->buf + done + n, '\n', s->len - done - n);
+	int l = nl ? nl - (s->buf + done + n) + 1 : s->len - done - n;
+	if (n > 0 && n + l > SINK_DGRAM_MAX) {
+	  break;
+	}
+	n += l;
+      }
+
+      w = send(s->fd, s->buf + done, n, 0);
+      if (w < 0) {
+	if (errno != EAGAIN) {
+	  sink_close(s);
+	}
+	break;
+      }
+      done += n;
+    }
+  }
+
+  memmove(s->buf, s->buf + done, s->len - done);
+  s->len -= done;
+  s->lines = count_lines(s->buf, s->len);
+  return done;
+}
+
+/**
+ * Moves spilled readings back into the buffer.
+ */
+static void unspill(sink *s, long long now)
+{
+  int n = s->size - s->len;
+  int r;
+
+  if (n > s->spill_end - s->spill_pos) {
+    n = s->spill_end - s->spill_pos;
+  }
+  if (n <= 0 || (r = pread(s->spill, s->buf + s->len, n, s->spill_pos)) <= 0) {
+    return;
+  }
+
+  /* Only take complete lines */
+  while (r > 0 && s->buf[s->len + r - 1] != '\n') {
+    r--;
+  }
+  if (s->lines == 0) {
+    s->oldest = now;
+  }
+  s->spill_pos += r;
+  s->len += r;
+  s->lines = count_lines(s->buf, s->len);
+
+  if (s->spill_pos == s->spill_end) {
+    if (0 == ftruncate(s->spill, 0)) {
+      s->spill_pos = s->spill_end = 0;
+    }
+  }
+}
+
+/**
+ * Writes the pending readings if the batch is full or old enough, or
+ * unconditionally if force is set.
+ */
+void sink_flush(sink *s, long long now, int force)
+{
+  if (s->len == 0 && s->spill_end == s->spill_pos) {
+    return;
+  }
+  if (!force && s->lines < s->batch_size && now - s->oldest < s->batch_age &&
+      s->spill_end == s->spill_pos) {
+    return;
+  }
+
+  if (s->fd < 0) {
+    sink_open(s);
+    if (s->fd < 0) {
+      return;
+    }
+  }
+
+  while (1) {
+    if (s->spill_end > s->spill_pos) {
+      unspill(s, now);
+    }
+    if (s->len == 0 || write_out(s) == 0 || s->fd < 0) {
+      break;
+    }
+  }
+}
+
+/**
+ * Returns the time when the sink has to be flushed next, or -1 if
+ * nothing is pending.
+ */
+long long sink_deadline(sink *s)
+{
+  if (s->len == 0) {
+    return -1;
+  }
+  return s->oldest + s->batch_age;
+}
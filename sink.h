@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __SINK_H
+#define __SINK_H
+
+#define SINK_FILE 0
+#define SINK_FIFO 1
+#define SINK_UDP 2
+#define SINK_UNIX 3
+
+/* Largest datagram sent to UDP and Unix sinks */
+#define SINK_DGRAM_MAX 8192
+
+/* Default batch: readings and age (ms) */
+#define SINK_BATCH_SIZE 100
+#define SINK_BATCH_AGE 5000
+
+/* Default buffer size (bytes) */
+#define SINK_BUFFER 65536
+
+/*
+ * An output for readings in InfluxDB line protocol. Readings are
+ * collected in a bounded buffer and written in batches, without blocking
+ * on FIFOs and sockets. Writes to regular files (file sinks and spill
+ * files) may block, O_NONBLOCK has no effect on them. If the sink does
+ * not keep up, new readings are spilled to a file or dropped.
+ */
+struct sink
+{
+  char *spec;
+  int type;
+  char *target;
+  int fd;
+
+  /* Pending readings */
+  char *buf;
+  int len;
+  int size;
+  int lines;
+  long long oldest;
+
+  /* Flush when this many readings are pending or the oldest one is
+     older than batch_age ms */
+  int batch_size;
+  long long batch_age;
+
+  /* Overflow file, -1 if readings are dropped instead */
+  int spill;
+  long spill_pos;
+  long spill_end;
+
+  long dropped;
+
+  /* Set for sinks from the configuration file */
+  int configured;
+
+  struct sink *next;
+};
+
+typedef struct sink sink;
+
+sink *sink_alloc(const char *spec, int size, const char *spill_dir);
+void sink_free(sink *s);
+int sink_push(sink *s, const char *line, int len, long long now);
+void sink_flush(sink *s, long long now, int force);
+long long sink_deadline(sink *s);
+
+#endif /* __SINK_H */
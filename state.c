@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "state.h"
+#include "timer.h"
+
+/* Flags of a record */
+#define IDENTIFIED 1
+#define FAST 2
+#define RECONCILED 4
+
+static unsigned char *put(unsigned char *b, long long v, int bytes)
+{
+  int i;
+
+  for (i = 0; i < bytes; i++) {
+    b[i] = (unsigned long long) v >> (8 * i);
+  }
+  return b + bytes;
+}
+
+static long long get(const unsigned char **b, int bytes)
+{
+  unsigned long long v = 0;
+  int i;
+
+  for (i = bytes - 1; i >= 0; i--) {
+    v = (v << 8) | (*b)[i];
+  }
+  *b += bytes;
+  /* Only numbers of 8 bytes may be negative */
+  return (long long) v;
+}
+
+/**
+ * Encodes the record of meter i. Returns its length, which is always
+ * STATE_RECORD.
+ */
+static int encode(poller *p, int i, long long now, unsigned char *rec)
+{
+  transducer *t = p->t;
+  int n = p->meters[i].address;
+  unsigned char *b = rec;
+  int flags = 0;
+  int k;
+
+  if (p->meters[i].identified) {
+    flags |= IDENTIFIED;
+  }
+  if (p->meters[i].fast) {
+    flags |= FAST;
+  }
+  if (p->meters[i].reconcile != 0) {
+    flags |= RECONCILED;
+  }
+
+  b = put(b, n, 1);
+  b = put(b, p->meters[i].origin, 1);
+  b = put(b, flags, 1);
+  b = put(b, t->transducers[n].type, 1);
+  b = put(b, t->transducers[n].max_volts, 2);
+  b = put(b, t->transducers[n].max_amps, 2);
+  b = put(b, p->meters[i].failures, 2);
+  b = put(b, p->meters[i].backoff, 8);
+  b = put(b, p->meters[i].next - now, 8);
+  b = put(b, now - p->meters[i].last_ok, 8);
+  b = put(b, p->meters[i].stamp, 8);
+  b = put(b, p->meters[i].epoch, 8);
+  for (k = 0; k < TR_FIELDS; k++) {
+    b = put(b, t->value[k][n], 8);
+  }
+  for (k = 0; k < 2; k++) {
+    b = put(b, p->meters[i].base[k], 8);
+    b = put(b, p->meters[i].energy[k], 8);
+    b = put(b, p->meters[i].rest[k], 8);
+  }
+  b = put(b, p->meters[i].reconcile - now, 8);
+  for (k = 0; k < TR_LATENCY_BUCKETS; k++) {
+    b = put(b, t->transducers[n].latency[k], 2);
+  }
+  b = put(b, t->transducers[n].latency_samples, 4);
+  b = put(b, t->transducers[n].reply_max, 2);
+  b = put(b, t->transducers[n].auto_timeout, 4);
+  return b - rec;
+}
+
+/**
+ * Encodes the state of all meters into buf, of at least STATE_SIZE bytes.
+ * Returns the length of the state file, or -1 if a record came out with
+ * the wrong length. Does no I/O, so that the bus loop can take the
+ * snapshot and leave the writing to the publisher.
+ */
+int state_encode(poller *p, unsigned char *buf)
+{
+  long long now = poller_now(p);
+  unsigned char *b = buf;
+  int i;
+
+  memcpy(b, STATE_MAGIC, 8);
+  b = put(b + 8, timer_wall_ns(), 8);
+  b = put(b, p->epoch, 8);
+  b = put(b, p->num_meters, 2);
+  b = put(b, STATE_RECORD, 2);
+
+  for (i = 0; i < p->num_meters; i++, b += STATE_RECORD) {
+    if (STATE_RECORD != encode(p, i, now, b)) {
+      return -1;
+    }
+  }
+  return b - buf;
+}
+
+/**
+ * Writes an encoded state to file. The file is replaced atomically, so
+ * that a crash leaves either the old or the new state. Returns 0, or -1
+ * if it cannot be written.
+ */
+int state_write(const char *file, const unsigned char *buf, int len)
+{
+  char tmp[1024];
+  int fd, ok;
+
+  if (len < 0 || snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= sizeof(tmp) ||
+      0 > (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644))) {
+    return -1;
+  }
+  ok = (len == write(fd, buf, len)) && (0 == fsync(fd));
+  if (0 != close(fd) || !ok || 0 != rename(tmp, file)) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+static void decode(poller *p, const unsigned char *b, long long now, long long downtime)
+{
+  transducer *t = p->t;
+  int n = get(&b, 1);
+  int origin = get(&b, 1);
+  int flags = get(&b, 1);
+  int type = get(&b, 1);
+  int max_volts = get(&b, 2);
+  int max_amps = get(&b, 2);
+  int i, k;
+  long long left;
+
+  if (0 > (i = poller_find_meter(p, n))) {
+    /* Only discovered meters come back on their own */
+    if (origin != POLLER_DISCOVERED || !p->discover || p->num_meters == 256) {
+      return;
+    }
+    i = poller_add_meter(p, n, POLLER_DISCOVERED);
+  }
+
+  if ((flags & IDENTIFIED) && TR_OK == tr_set_model(t, n, type, max_volts, max_amps)) {
+    p->meters[i].identified = 1;
+    p->meters[i].revalidate = 1;
+  }
+  p->meters[i].failures = get(&b, 2);
+  p->meters[i].backoff = get(&b, 8);
+  left = get(&b, 8) - downtime;
+  if (p->meters[i].backoff != 0) {
+    /* Dead addresses are probed when due, healthy ones are read right
+       away */
+    p->meters[i].next = now + (left > 0 ? left : 0);
+    tr_set_timeout(t, n, p->probe_timeout);
+  }
+  p->meters[i].last_ok = now - get(&b, 8) - downtime;
+  p->meters[i].stamp = get(&b, 8);
+  p->meters[i].epoch = get(&b, 8);
+  for (k = 0; k < TR_FIELDS; k++) {
+    t->value[k][n] = get(&b, 8);
+  }
+
+  /* Integrated energy continues from where it was, the gap is accounted
+     for by the next reconciliation */
+  for (k = 0; k < 2; k++) {
+    p->meters[i].base[k] = get(&b, 8);
+    p->meters[i].energy[k] = get(&b, 8);
+    p->meters[i].rest[k] = get(&b, 8);
+  }
+  left = get(&b, 8) - downtime;
+  if ((flags & RECONCILED) && p->meters[i].fast == ((flags & FAST) != 0)) {
+    p->meters[i].reconcile = now + (left > 0 ? left : 0);
+  }
+  p->meters[i].sampled = 0;
+
+  for (k = 0; k < TR_LATENCY_BUCKETS; k++) {
+    t->transducers[n].latency[k] = get(&b, 2);
+  }
+  t->transducers[n].latency_samples = get(&b, 4);
+  t->transducers[n].reply_max = get(&b, 2);
+  t->transducers[n].auto_timeout = get(&b, 4);
+}
+
+/**
+ * Restores the state of the meters from file. Meters which are no longer
+ * polled are skipped. Returns the number of records read, or -1 if the
+ * file is missing or not a state file.
+ */
+int state_load(poller *p, const char *file)
+{
+  unsigned char header[STATE_HEADER];
+  unsigned char rec[STATE_RECORD];
+  const unsigned char *b = header + 8;
+  long long now = poller_now(p);
+  long long saved, downtime, epoch;
+  int num, size;
+  FILE *f;
+  int i;
+
+  if (NULL == (f = fopen(file, "r"))) {
+    return -1;
+  }
+  if (1 != fread(header, sizeof(header), 1, f) || 0 != memcmp(header, STATE_MAGIC, 8)) {
+    fclose(f);
+    return -1;
+  }
+  saved = get(&b, 8);
+  epoch = get(&b, 8);
+  num = get(&b, 2);
+  size = get(&b, 2);
+  if (size != STATE_RECORD) {
+    fclose(f);
+    return -1;
+  }
+  p->epoch = epoch;
+
+  downtime = (timer_wall_ns() - saved) / 1000000;
+  if (downtime < 0) {
+    downtime = 0;
+  }
+  for (i = 0; i < num && 1 == fread(rec, sizeof(rec), 1, f); i++) {
+    decode(p, rec, now, downtime);
+  }
+  fclose(f);
+  return i;
+}
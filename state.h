@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __STATE_H
+#define __STATE_H
+
+#include "poller.h"
+
+/*
+ * The state file keeps what a poller learned about its meters, so that a
+ * restarted poller does not start cold. It starts with a header of 28
+ * bytes: the magic below, the wall clock time of the save (ns since the
+ * epoch), the last snapshot epoch, the number of records and the size of
+ * a record. A record of STATE_RECORD bytes per meter follows, with its
+ * model, health, schedule, last reading, integrated energy and reply
+ * latencies. Times of the poller's clock are stored relative to the save.
+ * All numbers are little endian.
+ */
+#define STATE_MAGIC "DSSTATE2"
+#define STATE_HEADER 28
+#define STATE_RECORD 308
+
+/* Largest state file */
+#define STATE_SIZE (STATE_HEADER + 256 * STATE_RECORD)
+
+int state_encode(poller *p, unsigned char *buf);
+int state_write(const char *file, const unsigned char *buf, int len);
+int state_load(poller *p, const char *file);
+
+#endif /* __STATE_H */
@@ -60,25 +60,47 @@ static const char *_finddelimiters(const char *s, const char *d)
 
 static void *_alloc(int size)
 {
-  void *m;
-  if (0 == (m = (void *) malloc(size))) {
-    perror("Unable to allocate memory (" __FILE__ ") ");
-    exit(1);
-  }
-  return m;
+#ifdef HEAPFREE
+  /* Heap free builds only use fixed strings, see str_fixed() */
+  return 0;
+#else
+  return (void *) malloc(size);
+#endif
+}
+
+/**
+ * Makes s an empty string in the given buffer of size bytes. Such a
+ * string never grows, appending beyond its size fails.
+ */
+string *str_fixed(string *s, char *buf, int size)
+{
+  s->alloc = -1;
+  s->len = 0;
+  s->content = buf;
+  s->content[0] = 0;
+  s->maxlen = size - 1;
+  return s;
 }
 
 
 string *str_alloc(string *s, int l)
 {
+  char *c;
+
+  if (0 == (c = _alloc(l+1))) {
+    return 0;
+  }
   if (!s) {
-    s = _alloc(sizeof(string));
+    if (0 == (s = _alloc(sizeof(string)))) {
+      free(c);
+      return 0;
+    }
     s->alloc = 1;
   } else {
     s->alloc = 0;
   }
   s->len = 0;
-  s->content = _alloc(l+1);
+  s->content = c;
   s->content[0] = 0;
   s->maxlen = l;
   return s;
@@ -86,7 +108,15 @@ string *str_alloc(string *s, int l)
 
 string *str_increase(struct string *s, int l)
 {
-  char *c = _alloc(l + 1);
+  char *c;
+
+  if (s->alloc < 0) {
+    return 0;
+  }
+  c = _alloc(l + 1);
+  if (0 == c) {
+    return 0;
+  }
   c[0] = '\0';
   if (0 != s->content) {
     _strcpy(s->content, c);
@@ -99,6 +129,13 @@ string *str_increase(struct string *s, int l)
 
 void str_free(string *s)
 {
+  if (!s) {
+    return;
+  }
+  if (s->alloc < 0) {
+    str_clear(s);
+    return;
+  }
   if (s->content) {
     free(s->content);
   }
@@ -120,7 +157,9 @@ void str_clear(string *s)
 string *str_create(string *s, const char *c)
 {
   int l = _strlen(c);
-  s = str_alloc(s, l);
+  if (0 == (s = str_alloc(s, l))) {
+    return 0;
+  }
   _strcpy(c, s->content);
   s->len = l;
   return s;
@@ -131,14 +170,15 @@ const char *str_getbuf(string *s)
   return s->content;
 }
 
-void str_replace(string *s, const char *c)
+int str_replace(string *s, const char *c)
 {
   int l = _strlen(c);
-  if (s->maxlen < l) {
-    str_increase(s, l);
+  if (s->maxlen < l && 0 == str_increase(s, l)) {
+    return -1;
   }
   _strcpy(c, s->content);
   s->len = l;
+  return 0;
 }
 
 int str_len(string *s)
@@ -154,33 +194,45 @@ int str_getc(string *s, int i)
   return s->content[i];
 }
 
-void str_append(string *s, string *d)
+int str_append(string *s, string *d)
 {
   int i;
   for (i = 0; i < s->len; i++) {
-    str_appendc(d, str_getc(s, i));
+    if (0 != str_appendc(d, str_getc(s, i))) {
+      return -1;
+    }
   }
+  return 0;
 }
 
-void str_appendc(string *s, char c)
+int str_appendc(string *s, char c)
 {
-  if (s->maxlen < s->len + 2) {
-    str_increase(s, s->maxlen + 64);
+  if (s->maxlen < s->len + 2 && 0 == str_increase(s, s->maxlen + 64)) {
+    return -1;
   }
   s->content[s->len] = c;
   s->content[s->len+1] = 0;
   s->len++;
+  return 0;
 }
 
-void str_sprintf(string *s, int size, const char *format, ...)
+int str_sprintf(string *s, int size, const char *format, ...)
 {
   va_list va;
+  int l;
 
-  if (s->maxlen < size) {
-    str_increase(s, size);
+  if (s->maxlen < size && 0 == str_increase(s, size)) {
+    return -1;
   }
   va_start(va, format);
-  s->len = vsnprintf(s->content, size+1, format, va);
+  l = vsnprintf(s->content, size+1, format, va);
+  va_end(va);
+  if (l < 0) {
+    return -1;
+  }
+  /* vsnprintf returns the untruncated length */
+  s->len = (l > size) ? size : l;
+  return s->len;
 }
 
 int str_cmp(string *s1, string *s2)
@@ -218,7 +270,9 @@ int str_tok(string *t, int n, const char *s, const char *d)
     e = _finddelimiters(s, d);
     str_clear(&t[i]);
     while (*s != *e) {
-      str_appendc(&t[i], *s++);
+      if (0 != str_appendc(&t[i], *s++)) {
+	return -1;
+      }
     }
     s = e;
   }
@@ -235,13 +289,19 @@ string *str_substring(string *s, int start, int length)
   } else {
     d = str_alloc(NULL, str_len(s) - start);
   }
+  if (0 == d) {
+    return 0;
+  }
 
   for (i = 0; (i < length || length == 0); i++) {
     int c = str_getc(s, start+i);
     if (c == -1) {
       return d;
     }
-    str_appendc(d, c);
+    if (0 != str_appendc(d, c)) {
+      str_free(d);
+      return 0;
+    }
   }
 
   return d;
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <time.h>
+
+#include "timer.h"
+
+/**
+ * Monotonic time in nanoseconds. Not related to the wall clock, only
+ * useful for measuring intervals.
+ */
+long long timer_now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Wall clock time in nanoseconds since the epoch, for timestamps.
+ */
+long long timer_wall_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long timer_now_ms()
+{
+  return timer_now_ns() / 1000000LL;
+}
+
+/**
+ * Sleeps for ms milliseconds, or until a signal arrives.
+ */
+void timer_sleep_ms(long long ms)
+{
+  struct timespec ts;
+
+  if (ms <= 0) {
+    return;
+  }
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+}
@@ -0,0 +1,13 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __TIMER_H
+#define __TIMER_H
+
+long long timer_now_ms();
+long long timer_now_ns();
+long long timer_wall_ns();
+void timer_sleep_ms(long long ms);
+
+#endif /* __TIMER_H */
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static void *writer(void *arg)
+{
+  trace *tr = arg;
+  char *out;
+  int stop;
+
+  if (NULL == (out = malloc(TRACE_BUFFER))) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&tr->mutex);
+  do {
+    struct timespec until;
+    char *full;
+    int len;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += TRACE_FLUSH / 1000;
+    until.tv_nsec += (TRACE_FLUSH % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    if (!tr->stop && tr->len < TRACE_BUFFER / 2) {
+      pthread_cond_timedwait(&tr->cond, &tr->mutex, &until);
+    }
+
+    /* Swap buffers and write outside of the lock */
+    full = tr->buf;
+    len = tr->len;
+    tr->buf = out;
+    tr->len = 0;
+    stop = tr->stop;
+    pthread_mutex_unlock(&tr->mutex);
+
+    fwrite(full, 1, len, tr->file);
+    fflush(tr->file);
+    out = full;
+
+    pthread_mutex_lock(&tr->mutex);
+  } while (!stop);
+  pthread_mutex_unlock(&tr->mutex);
+
+  free(out);
+  return NULL;
+}
+
+/**
+ * Creates a trace file and starts its writer thread.
+ */
+trace *trace_open(const char *file)
+{
+  trace *tr;
+
+  if (NULL == (tr = calloc(1, sizeof(trace)))) {
+    return NULL;
+  }
+  if (NULL == (tr->buf = malloc(TRACE_BUFFER))) {
+    free(tr);
+    return NULL;
+  }
+  if (NULL == (tr->file = fopen(file, "w"))) {
+    free(tr->buf);
+    free(tr);
+    return NULL;
+  }
+  tr->pid = getpid();
+  fprintf(tr->file, "[\n");
+
+  pthread_mutex_init(&tr->mutex, NULL);
+  pthread_cond_init(&tr->cond, NULL);
+  if (0 != pthread_create(&tr->writer, NULL, writer, tr)) {
+    fclose(tr->file);
+    free(tr->buf);
+    free(tr);
+    return NULL;
+  }
+  return tr;
+}
+
+/**
+ * Writes all pending events and closes the trace.
+ */
+void trace_close(trace *tr)
+{
+  if (tr == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&tr->mutex);
+  tr->stop = 1;
+  pthread_cond_signal(&tr->cond);
+  pthread_mutex_unlock(&tr->mutex);
+  pthread_join(tr->writer, NULL);
+
+  fprintf(tr->file,
+	  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	  "\"args\":{\"name\":\"dsreadout\",\"dropped_events\":%ld}}\n]\n",
+	  tr->pid, tr->dropped);
+  fclose(tr->file);
+
+  pthread_mutex_destroy(&tr->mutex);
+  pthread_cond_destroy(&tr->cond);
+  free(tr->buf);
+  free(tr);
+}
+
+/**
+ * Adds a complete event on a track, with start and end in monotonic ns.
+ * args is a JSON object or NULL.
+ */
+void trace_complete(trace *tr, const char *name, int track,
+		    long long start, long long end, const char *args)
+{
+  char event[512];
+  int len;
+
+  len = snprintf(event, sizeof(event),
+		 "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+		 "\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,\"args\":%s},\n",
+		 name, tr->pid, track, start / 1000, start % 1000,
+		 (end - start) / 1000, (end - start) % 1000, args ? args : "{}");
+  if (len >= sizeof(event)) {
+    return;
+  }
+
+  pthread_mutex_lock(&tr->mutex);
+  if (tr->len + len > TRACE_BUFFER) {
+    tr->dropped++;
+  } else {
+    memcpy(tr->buf + tr->len, event, len);
+    tr->len += len;
+    if (tr->len >= TRACE_BUFFER / 2) {
+      pthread_cond_signal(&tr->cond);
+    }
+  }
+  pthread_mutex_unlock(&tr->mutex);
+}
+
+/**
+ * Names a track of the timeline.
+ */
+void trace_track(trace *tr, int track, const char *name)
+{
+  char event[256];
+  int len;
+
+  len = snprintf(event, sizeof(event),
+		 "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+		 "\"args\":{\"name\":\"%s\"}},\n", tr->pid, track, name);
+  if (len < sizeof(event)) {
+    pthread_mutex_lock(&tr->mutex);
+    if (tr->len + len <= TRACE_BUFFER) {
+      memcpy(tr->buf + tr->len, event, len);
+      tr->len += len;
+    }
+    pthread_mutex_unlock(&tr->mutex);
+  }
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2007-2015 Oliver Hitz <oliver@net-track.ch>
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+/* Size of each of the two event buffers */
+#define TRACE_BUFFER 65536
+
+/* Interval at which the buffer is written out (ms) */
+#define TRACE_FLUSH 1000
+
+/*
+ * A timeline of events in the Chrome trace event format (JSON array),
+ * which can be loaded into chrome://tracing or Perfetto. Events are
+ * collected in memory and written by a background thread, events which
+ * do not fit into the buffer are dropped and counted.
+ */
+struct trace
+{
+  FILE *file;
+  int pid;
+
+  pthread_t writer;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int stop;
+
+  char *buf;
+  int len;
+  long dropped;
+};
+
+typedef struct trace trace;
+
+trace *trace_open(const char *file);
+void trace_close(trace *tr);
+void trace_track(trace *tr, int track, const char *name);
+void trace_complete(trace *tr, const char *name, int track,
+		    long long start, long long end, const char *args);
+
+#endif /* __TRACE_H */
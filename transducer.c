@@ -1,25 +1,211 @@
-
 #include <stdio.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/file.h>
 #include <sys/time.h>
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <math.h>
 
 #include "debug.h"
 #include "transducer.h"
 #include "serial.h"
 #include "string.h"
+#include "timer.h"
+
+/* Tracks of the trace timeline */
+#define TRACK_BUS 1
+#define TRACK_LOCK 2
+
+/* Shorter waits for the bus are not traced (ns) */
+#define TRACE_WAIT_MIN 1000000LL
+
+void tr_set_verbose(transducer *t, int level)
+{
+  t->verbose = level;
+}
+
+/**
+ * Folds the transducer's range and the transformer ratios into one
+ * multiplier per quantity, so that decoding needs integer arithmetic only.
+ */
+static void update_scale(transducer *t, int n)
+{
+  double volts = t->transducers[n].max_volts * t->transducers[n].pt;
+  double amps = t->transducers[n].max_amps * t->transducers[n].ct;
+
+  t->transducers[n].scale_volts = llround(volts * 1000);
+  t->transducers[n].scale_amps = llround(amps * 1000);
+  t->transducers[n].scale_power = llround(volts * amps * 1000);
+}
+
+/**
+ * Sets the reply timeout (ms) for address n, or the default for all
+ * addresses if n is -1. A timeout of 0 resets an address to the default.
+ */
+void tr_set_timeout(transducer *t, int n, int timeout)
+{
+  if (n < 0) {
+    t->timeout = timeout;
+  } else {
+    t->transducers[n].timeout = timeout;
+  }
+}
+
+/**
+ * Makes replies time out at the monotonic time deadline (ns, see
+ * timer_now_ns()), even if the transducer is still sending, or lifts
+ * the deadline if it is 0. The reply timeout between characters applies
+ * as well.
+ */
+void tr_set_deadline(transducer *t, long long deadline)
+{
+  t->ser.deadline = deadline;
+}
+
+/**
+ * Returns true if transformer ratios are positive and keep the full scale
+ * power of every model within TR_SCALE_MAX.
+ */
+int tr_valid_ratio(double ct, double pt)
+{
+  return ct > 0 && pt > 0 && TR_MODEL_VA_MAX * 1000.0 * ct * pt <= TR_SCALE_MAX;
+}
+
+/**
+ * Sets the ratios of the external current and voltage transformers used
+ * with the transducer at address n, e.g. 40 for a 200:5 CT. Returns
+ * TR_ERROR if the ratios are not valid, see tr_valid_ratio().
+ */
+int tr_set_ratio(transducer *t, int n, double ct, double pt)
+{
+  if (!tr_valid_ratio(ct, pt)) {
+    return TR_ERROR;
+  }
+  t->transducers[n].ct = ct;
+  t->transducers[n].pt = pt;
+  update_scale(t, n);
+  return TR_OK;
+}
+
+/**
+ * Sets the model of transducer n without asking it, e.g. as known from an
+ * earlier run. Returns TR_UNKNOWN_MODEL if the type is invalid.
+ */
+int tr_set_model(transducer *t, int n, int type, int max_volts, int max_amps)
+{
+  if (type != TR_1PHASE && type != TR_3PHASE4WIRE) {
+    return TR_UNKNOWN_MODEL;
+  }
+  t->transducers[n].type = type;
+  t->transducers[n].max_volts = max_volts;
+  t->transducers[n].max_amps = max_amps;
+  update_scale(t, n);
+  return TR_OK;
+}
+
+/**
+ * Enables timeouts derived from the observed reply latency of every
+ * address, within min and max ms. A min of 0 disables them again.
+ */
+void tr_set_auto_timeout(transducer *t, int min, int max)
+{
+  t->timeout_min = min;
+  t->timeout_max = max;
+}
+
+/**
+ * Returns the reply timeout (ms) currently used for address n.
+ */
+int tr_timeout(transducer *t, int n)
+{
+  if (t->transducers[n].timeout > 0) {
+    return t->transducers[n].timeout;
+  }
+  if (t->timeout_min > 0 && t->transducers[n].auto_timeout > 0) {
+    return t->transducers[n].auto_timeout;
+  }
+  return t->timeout;
+}
+
+static int reply_timeout(transducer *t, int n)
+{
+  return tr_timeout(t, n);
+}
 
-int verbose = 0;
+/* Lower bound (us) of a latency bucket, and the bucket of a latency */
+static long long bucket_floor(int b)
+{
+  return (1LL << (b / 2)) * (2 + b % 2) / 2;
+}
 
-void tr_set_verbose(int level)
+static int bucket(long long us)
 {
-  verbose = level;
+  int b = 0;
+
+  while (b + 1 < TR_LATENCY_BUCKETS && bucket_floor(b + 1) <= us) {
+    b++;
+  }
+  return b;
+}
+
+/**
+ * Returns a percentile of the reply latencies (us) of address n, as the
+ * upper bound of its bucket, or -1 if there are too few of them.
+ */
+long long tr_latency(transducer *t, int n, int percent)
+{
+  unsigned short *h = t->transducers[n].latency;
+  int total = t->transducers[n].latency_samples;
+  int seen, b;
+
+  if (total < TR_LATENCY_MIN_SAMPLES) {
+    return -1;
+  }
+  for (b = TR_LATENCY_BUCKETS - 1, seen = 0; b > 0; b--) {
+    if ((seen += h[b]) * 100 > total * (100 - percent)) {
+      break;
+    }
+  }
+  return bucket_floor(b + 1);
+}
+
+/**
+ * Adds a reply latency (us) of address n to its histogram and derives
+ * the timeout from it.
+ */
+static void record_latency(transducer *t, int n, long long us, int reply)
+{
+  unsigned short *h = t->transducers[n].latency;
+  int b;
+  long long p99;
+
+  h[bucket(us)]++;
+  if (reply > t->transducers[n].reply_max) {
+    t->transducers[n].reply_max = reply;
+  }
+  if (++t->transducers[n].latency_samples >= TR_LATENCY_WINDOW) {
+    t->transducers[n].latency_samples = 0;
+    for (b = 0; b < TR_LATENCY_BUCKETS; b++) {
+      t->transducers[n].latency_samples += (h[b] /= 2);
+    }
+  }
+
+  if (0 > (p99 = tr_latency(t, n, 99))) {
+    return;
+  }
+
+  /* Ten bits per byte on the wire */
+  t->transducers[n].auto_timeout = p99 * TR_TIMEOUT_MARGIN / 1000 +
+    t->transducers[n].reply_max * 10000LL / t->baud + 1;
+  if (t->transducers[n].auto_timeout < t->timeout_min) {
+    t->transducers[n].auto_timeout = t->timeout_min;
+  } else if (t->transducers[n].auto_timeout > t->timeout_max) {
+    t->transducers[n].auto_timeout = t->timeout_max;
+  }
 }
 
 transducer *tr_alloc()
@@ -27,9 +213,30 @@ transducer *tr_alloc()
   int i;
   transducer *t;
 
-  t = (void *) malloc(sizeof(transducer));
+  if (NULL == (t = (void *) malloc(sizeof(transducer)))) {
+    return NULL;
+  }
 
+  serial_init(&t->ser, -1);
+  lock_init(&t->lock);
+  t->verbose = 0;
+  t->trace = NULL;
+  t->timeout = SER_TIMEOUT_DEFAULT;
+  t->timeout_min = 0;
+  t->timeout_max = 0;
+  t->baud = 9600;
+  str_fixed(&t->cmd, t->cmd_buf, sizeof(t->cmd_buf));
+  str_fixed(&t->line, t->line_buf, sizeof(t->line_buf));
+  memset(t->transducers, 0, sizeof(t->transducers));
+  memset(t->value, 0, sizeof(t->value));
+  t->queue_head = 0;
+  t->queue_len = 0;
+  t->state = TR_IDLE;
   for (i = 0; i < 256; i++) {
+    t->transducers[i].ct = 1.0;
+    t->transducers[i].pt = 1.0;
+    t->transducers[i].timeout = 0;
+    t->transducers[i].type = TR_1PHASE;
     t->transducers[i].max_volts = 0;
     t->transducers[i].max_amps = 0;
   }
@@ -41,156 +248,302 @@ void tr_free(transducer *t)
   free(t);
 }
 
-int tr_read(transducer *t, int n)
+/**
+ * Parses a fixed width decimal field of a reply into an integer with the
+ * given number of decimals, e.g. "+0.7654" with 6 decimals is 765400.
+ * Surplus decimals are truncated.
+ */
+static long long parse_fixed(string *line, int start, int length, int decimals)
 {
-  int result = TR_OK;
+  long long value = 0;
+  int negative = 0;
+  int dot = -1;
+  int i;
 
-  string *line = str_alloc(NULL, 80);
-  string *cmd = str_alloc(NULL, 20);
-  string *value;
+  for (i = start; i < start + length; i++) {
+    int c = str_getc(line, i);
 
-  str_sprintf(cmd, 10, "#%02XA\r", n);
+    if (c >= '0' && c <= '9') {
+      if (dot < 0 || dot < decimals) {
+	value = value * 10 + (c - '0');
+	if (dot >= 0) {
+	  dot++;
+	}
+      }
+    } else if (c == '.' && dot < 0) {
+      dot = 0;
+    } else if (c == '-') {
+      negative = 1;
+    }
+  }
+  for (dot = (dot < 0) ? 0 : dot; dot < decimals; dot++) {
+    value *= 10;
+  }
+  return negative ? -value : value;
+}
 
-  serial_write(t->fd, cmd);
+/**
+ * Scales a fraction of full scale (in millionths) to engineering units.
+ */
+static long long scale(long long fraction, long long full)
+{
+  return fraction * full / TR_FRACTION;
+}
 
-  if (SER_OK == serial_readline(t->fd, line)) {
+/**
+ * Parses a fixed width hexadecimal field of a reply, up to the first
+ * character which is not a hex digit.
+ */
+static int parse_hex(string *line, int start, int length)
+{
+  int value = 0;
+  int i;
 
-    if (verbose > 0) {
-      printf("Read all data returned '%s'\n", str_getbuf(line));
-    }
+  for (i = start; i < start + length; i++) {
+    int c = str_getc(line, i);
 
-    if (t->transducers[n].type == TR_1PHASE) {
-      value = str_substring(line, 1, 7);
-      t->transducers[n].voltage_f1 = atof(str_getbuf(value));
-      str_free(value);
-
-      value = str_substring(line, 8, 7);
-      t->transducers[n].current_f1 = atof(str_getbuf(value));
-      str_free(value);
-      
-      value = str_substring(line, 15, 7);
-      t->transducers[n].power_f = atof(str_getbuf(value));
-      str_free(value);
-      
-      value = str_substring(line, 22, 7);
-      t->transducers[n].vars_f = atof(str_getbuf(value));
-      str_free(value);
-      
-      value = str_substring(line, 29, 7);
-      t->transducers[n].pfactor_f = atof(str_getbuf(value));
-      str_free(value);
-      
-      value = str_substring(line, 36, 6);
-      t->transducers[n].frequency = atof(str_getbuf(value));
-      str_free(value);
-    } else if (t->transducers[n].type == TR_3PHASE4WIRE) {
-      value = str_substring(line, 1, 7);
-      t->transducers[n].voltage_f1 = atof(str_getbuf(value));
-      str_free(value);
-
-      value = str_substring(line, 8, 7);
-      t->transducers[n].current_f1 = atof(str_getbuf(value));
-      str_free(value);
-
-      value = str_substring(line, 15, 7);
-      t->transducers[n].voltage_f2 = atof(str_getbuf(value));
-      str_free(value);
-
-      value = str_substring(line, 22, 7);
-      t->transducers[n].current_f2 = atof(str_getbuf(value));
-      str_free(value);
-
-      value = str_substring(line, 29, 7);
-      t->transducers[n].voltage_f3 = atof(str_getbuf(value));
-      str_free(value);
-
-      value = str_substring(line, 36, 7);
-      t->transducers[n].current_f3 = atof(str_getbuf(value));
-      str_free(value);
-
-      value = str_substring(line, 43, 7);
-      t->transducers[n].power_f = atof(str_getbuf(value));
-      str_free(value);
-      
-      value = str_substring(line, 50, 7);
-      t->transducers[n].vars_f = atof(str_getbuf(value));
-      str_free(value);
-      
-      value = str_substring(line, 57, 7);
-      t->transducers[n].pfactor_f = atof(str_getbuf(value));
-      str_free(value);
-      
-      value = str_substring(line, 64, 6);
-      t->transducers[n].frequency = atof(str_getbuf(value));
-      str_free(value);
+    if (c >= '0' && c <= '9') {
+      value = value * 16 + (c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      value = value * 16 + (c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      value = value * 16 + (c - 'A' + 10);
+    } else {
+      break;
     }
+  }
+  return value;
+}
+
+/**
+ * Returns the command and reply buffers of the handle, emptied, or
+ * TR_LOCK while they belong to an operation of the non-blocking API.
+ */
+static int buffers(transducer *t, string **line, string **cmd)
+{
+  if (t->state != TR_IDLE) {
+    return TR_LOCK;
+  }
+  *line = &t->line;
+  *cmd = &t->cmd;
+  str_clear(*line);
+  str_clear(*cmd);
+  return TR_OK;
+}
+
+/**
+ * Adds a transaction to the trace: the time spent waiting for the bus,
+ * and the exchange itself from the command to the end of the reply.
+ */
+static void trace_transaction(transducer *t, int n, string *cmd, long long start,
+			      int result, int rc, int timeout)
+{
+  long long end = timer_now_ns();
+  serial *s = &t->ser;
+  char name[16];
+  char args[256];
+  char first[32] = "null";
+  const char *outcome;
+  int len = str_len(cmd);
+
+  /* The command without its trailing \r */
+  if (len > 0 && str_getc(cmd, len - 1) == '\r') {
+    len--;
+  }
+  snprintf(name, sizeof(name), "%.*s", len, str_getbuf(cmd));
 
+  if (result == TR_LOCK) {
+    trace_complete(t->trace, "busy", TRACK_LOCK, start, end, NULL);
+    return;
+  }
+  if (s->write_time - start > TRACE_WAIT_MIN) {
+    trace_complete(t->trace, "wait", TRACK_LOCK, start, s->write_time, NULL);
+  }
+
+  if (rc == SER_OK) {
+    outcome = "ok";
+  } else if (rc == SER_TIMEOUT) {
+    outcome = "timeout";
   } else {
-    result = TR_ERROR;
+    outcome = "error";
   }
+  if (s->first_byte != 0) {
+    snprintf(first, sizeof(first), "%lld", (s->first_byte - s->write_time) / 1000);
+  }
+  snprintf(args, sizeof(args),
+	   "{\"address\":%d,\"command\":\"%s\",\"written\":%d,\"read\":%d,"
+	   "\"first_byte_us\":%s,\"timeout_ms\":%d,\"outcome\":\"%s\"}",
+	   n, name, s->bytes_written, s->bytes_read, first, timeout, outcome);
+  trace_complete(t->trace, name, TRACK_BUS, s->write_time, end, args);
+}
 
-  str_free(line);
-  str_free(cmd);
+/**
+ * Bookkeeping after a transaction: the latency of the reply for auto
+ * timeouts, and the trace.
+ */
+static void transaction_done(transducer *t, int n, string *cmd, long long start,
+			     int result, int rc, int timeout)
+{
+  if (result != TR_LOCK && t->timeout_min > 0 && t->transducers[n].timeout == 0) {
+    if (rc == SER_OK && t->ser.first_byte != 0) {
+      record_latency(t, n, (t->ser.first_byte - t->ser.write_time) / 1000,
+		     t->ser.bytes_read);
+    } else if (rc == SER_TIMEOUT && t->transducers[n].auto_timeout > 0) {
+      /* Too short for a device which slowed down: count the timeout
+	 itself, so that the next one is longer */
+      record_latency(t, n, timeout * 1000LL, 0);
+    }
+  }
+  if (t->trace) {
+    trace_transaction(t, n, cmd, start, result, rc, timeout);
+  }
+}
+
+/**
+ * Drops what arrived of a reply which came too late, so that it is not
+ * taken for the reply to the next command. Not for replays, which only
+ * ever return what was recorded.
+ */
+static void drop_input(transducer *t)
+{
+  if (!t->ser.replay) {
+    tcflush(t->ser.fd, TCIFLUSH);
+  }
+}
+
+/**
+ * Sends a command to transducer n and reads its reply, as one
+ * transaction.
+ */
+static int transaction(transducer *t, int n, string *cmd, string *line)
+{
+  long long start = t->trace ? timer_now_ns() : 0;
+  int timeout = reply_timeout(t, n);
+  int rc = SER_ERROR;
+  int result;
+
+  if (TR_OK == (result = tr_begin(t))) {
+    serial_write(&t->ser, cmd);
+    if (SER_OK != (rc = serial_readline(&t->ser, line, timeout))) {
+      result = TR_ERROR;
+      drop_input(t);
+    }
+    tr_end(t);
+  }
+  transaction_done(t, n, cmd, start, result, rc, timeout);
   return result;
 }
 
-int tr_read_energy(transducer *t, int n)
+/**
+ * Formats the (first) command of an operation.
+ */
+static void command(string *cmd, int n, int op)
 {
-  int result = TR_OK;
+  switch (op) {
+  case TR_OP_IDENTIFY:
+    str_sprintf(cmd, 10, "$%02XM\r", n);
+    break;
+  case TR_OP_READ:
+    str_sprintf(cmd, 10, "#%02XA\r", n);
+    break;
+  case TR_OP_ENERGY:
+  case TR_OP_CLEAR:
+    str_sprintf(cmd, 10, "#%02XW\r", n);
+    break;
+  }
+}
+
+/**
+ * Decodes the reply to the read all command.
+ */
+static int decode_read(transducer *t, int n, string *line)
+{
+  long long v[TR_FIELDS];
+  long long volts = t->transducers[n].scale_volts;
+  long long amps = t->transducers[n].scale_amps;
+  long long power = t->transducers[n].scale_power;
+  int field;
+
+  if (t->verbose > 0) {
+    printf("Read all data returned '%s'\n", str_getbuf(line));
+  }
 
-  string *line = str_alloc(NULL, 80);
-  string *cmd = str_alloc(NULL, 20);
-  string *value;
+  /* A reply of the wrong length comes from a different model */
+  if (str_len(line) != ((t->transducers[n].type == TR_1PHASE) ? 42 : 70)) {
+    return TR_ERROR;
+  }
+
+  for (field = 0; field < TR_FIELDS; field++) {
+    v[field] = t->value[field][n];
+  }
+  if (t->transducers[n].type == TR_1PHASE) {
+    v[TR_VOLTAGE1] = scale(parse_fixed(line, 1, 7, 6), volts);
+    v[TR_CURRENT1] = scale(parse_fixed(line, 8, 7, 6), amps);
+    v[TR_POWER] = scale(parse_fixed(line, 15, 7, 6), power);
+    v[TR_VARS] = scale(parse_fixed(line, 22, 7, 6), power);
+    v[TR_PFACTOR] = parse_fixed(line, 29, 7, 6);
+    v[TR_FREQUENCY] = parse_fixed(line, 36, 6, 3);
+  } else if (t->transducers[n].type == TR_3PHASE4WIRE) {
+    v[TR_VOLTAGE1] = scale(parse_fixed(line, 1, 7, 6), volts);
+    v[TR_CURRENT1] = scale(parse_fixed(line, 8, 7, 6), amps);
+    v[TR_VOLTAGE2] = scale(parse_fixed(line, 15, 7, 6), volts);
+    v[TR_CURRENT2] = scale(parse_fixed(line, 22, 7, 6), amps);
+    v[TR_VOLTAGE3] = scale(parse_fixed(line, 29, 7, 6), volts);
+    v[TR_CURRENT3] = scale(parse_fixed(line, 36, 7, 6), amps);
+    v[TR_POWER] = scale(parse_fixed(line, 43, 7, 6), power);
+    v[TR_VARS] = scale(parse_fixed(line, 50, 7, 6), power);
+    v[TR_PFACTOR] = parse_fixed(line, 57, 7, 6);
+    v[TR_FREQUENCY] = parse_fixed(line, 64, 6, 3);
+  }
+  for (field = 0; field < TR_FIELDS; field++) {
+    t->value[field][n] = v[field];
+  }
+  return TR_OK;
+}
 
-  str_sprintf(cmd, 10, "#%02XW\r", n);
+/**
+ * Converts a totalizer, which counts full scale power seconds, to mWh.
+ * Divided first, so that the product stays in range.
+ */
+static long long energy(long long count, long long power)
+{
+  return count / 3600 * power + count % 3600 * power / 3600;
+}
 
-  serial_write(t->fd, cmd);
+/**
+ * Decodes the reply to the energy command.
+ */
+static int decode_energy(transducer *t, int n, string *line)
+{
+  int checksum_calc = 0;
+  int checksum_read;
+  int i;
 
-  if (SER_OK == serial_readline(t->fd, line)) {
+  if (19 != str_len(line)) {
+    return TR_ERROR;
+  }
 
-    if (19 != str_len(line)) {
-      result = TR_ERROR;
-    } else {
-      /* Calculate checksum */
-      int i;
-      int checksum_calc = 0;
-      int checksum_read;
-      for (i = 0; i < 17; i++) {
-	checksum_calc += str_getc(line, i);
-      }
-      checksum_calc &= 0xff;
-
-      /* Parse data */
-      value = str_substring(line, 1, 2);
-      t->transducers[n].time_period = atoi(str_getbuf(value));
-      str_free(value);
-      
-      value = str_substring(line, 3, 7);
-      sscanf(str_getbuf(value), "%x", &t->transducers[n].kwhr);
-      str_free(value);
-      
-      value = str_substring(line, 10, 7);
-      sscanf(str_getbuf(value), "%x", &t->transducers[n].kvarhr);
-      str_free(value);
-
-      value = str_substring(line, 17, 2);
-      sscanf(str_getbuf(value), "%x", &checksum_read);
-      str_free(value);
-
-      if (checksum_calc != checksum_read) {
-	result = TR_ERROR;
-      }
-    }
-  } else {
-    result = TR_ERROR;
+  /* Calculate checksum */
+  for (i = 0; i < 17; i++) {
+    checksum_calc += str_getc(line, i);
+  }
+  checksum_calc &= 0xff;
+
+  /* Parse data */
+  t->transducers[n].time_period = parse_fixed(line, 1, 2, 0);
+  t->transducers[n].kwhr = parse_hex(line, 3, 7);
+  t->transducers[n].kvarhr = parse_hex(line, 10, 7);
+  checksum_read = parse_hex(line, 17, 2);
+  if (checksum_calc != checksum_read) {
+    return TR_ERROR;
   }
 
-  str_free(line);
-  str_free(cmd);
-  return result;
+  t->value[TR_KWHR][n] = energy(t->transducers[n].kwhr, t->transducers[n].scale_power);
+  t->value[TR_KVARHR][n] = energy(t->transducers[n].kvarhr, t->transducers[n].scale_power);
+  return TR_OK;
 }
 
-int htoi(const char *h)
+static int htoi(const char *h)
 {
   int result = 0;
   while (*h) {
@@ -210,119 +563,397 @@ int htoi(const char *h)
   return result;
 }
 
-int tr_clear_energy(transducer *t, int n)
+/**
+ * Takes the time period from the reply to the energy command and formats
+ * the clear command with it.
+ */
+static void clear_command(transducer *t, int n, string *line, string *cmd)
+{
+  char period[3];
+
+  snprintf(period, sizeof(period), "%s", (str_len(line) > 1) ? str_getbuf(line) + 1 : "");
+  t->transducers[n].time_period = htoi(period);
+  str_sprintf(cmd, 10, "&%02X%02X\r", n, t->transducers[n].time_period);
+}
+
+/**
+ * Checks the reply to the clear command.
+ */
+static int decode_clear(int n, string *line)
+{
+  char expected[10];
+
+  snprintf(expected, sizeof(expected), "!%02X", n);
+  return (0 == strcmp(str_getbuf(line), expected)) ? TR_OK : TR_ERROR;
+}
+
+/**
+ * Decodes the reply to the identify command.
+ */
+static int decode_identify(transducer *t, int n, string *line)
+{
+  int result = TR_UNKNOWN_MODEL;
+  const char *model;
+
+  if (t->verbose > 0) {
+    printf("Read transducer name returned '%s'\n", str_getbuf(line));
+  }
+
+  /* First character has to be !, followed by the address and the model
+     string */
+  if ('!' == str_getc(line, 0) && str_len(line) >= 3) {
+    model = str_getbuf(line) + 3;
+
+    if (0 == strcmp(model, "CRD5110-300-25")) {
+      t->transducers[n].type = TR_1PHASE;
+      t->transducers[n].max_volts = 300;
+      t->transducers[n].max_amps = 25;
+      result = TR_OK;
+    } else if (0 == strcmp(model, "CRD5170-300-5")) {
+      t->transducers[n].type = TR_3PHASE4WIRE;
+      t->transducers[n].max_volts = 300;
+      t->transducers[n].max_amps = 5;
+      result = TR_OK;
+    }
+    if (result == TR_OK) {
+      update_scale(t, n);
+    }
+  }
+  return result;
+}
+
+int tr_read(transducer *t, int n)
 {
-  int result = TR_OK;
+  int result;
 
-  string *line = str_alloc(NULL, 80);
-  string *cmd = str_alloc(NULL, 20);
-  string *value;
+  string *line;
+  string *cmd;
 
-  str_sprintf(cmd, 10, "#%02XW\r", n);
+  if (TR_OK != buffers(t, &line, &cmd)) {
+    return TR_LOCK;
+  }
+  command(cmd, n, TR_OP_READ);
 
-  serial_write(t->fd, cmd);
+  if (TR_OK == (result = transaction(t, n, cmd, line))) {
+    result = decode_read(t, n, line);
+  }
+  return result;
+}
 
-  if (SER_OK == serial_readline(t->fd, line)) {
-    /* Get time period */
-    value = str_substring(line, 1, 2);
-    t->transducers[n].time_period = htoi(str_getbuf(value));
-    str_free(value);
+int tr_read_energy(transducer *t, int n)
+{
+  int result;
 
-    /* Construct and send clear command */
-    str_sprintf(cmd, 10, "&%02X%02X\r", n, t->transducers[n].time_period);
-    serial_write(t->fd, cmd);
+  string *line;
+  string *cmd;
 
-    /* Expected result */
-    str_sprintf(cmd, 10, "!%02X", n);
+  if (TR_OK != buffers(t, &line, &cmd)) {
+    return TR_LOCK;
+  }
+  command(cmd, n, TR_OP_ENERGY);
 
+  if (TR_OK == (result = transaction(t, n, cmd, line))) {
+    result = decode_energy(t, n, line);
+  }
+  return result;
+}
+
+int tr_clear_energy(transducer *t, int n)
+{
+  int result = TR_ERROR;
+
+  string *line;
+  string *cmd;
+
+  if (TR_OK != buffers(t, &line, &cmd)) {
+    return TR_LOCK;
+  }
+  command(cmd, n, TR_OP_CLEAR);
+
+  /* Both commands in one transaction */
+  if (TR_OK != tr_begin(t)) {
+    return TR_LOCK;
+  }
+
+  if (TR_OK == transaction(t, n, cmd, line)) {
+    clear_command(t, n, line, cmd);
     str_clear(line);
-    if (SER_OK == serial_readline(t->fd, line)) {
-      if (0 != str_cmp(line, cmd)) {
-	result = TR_ERROR;
-      }
-    } else {
-      result = TR_ERROR;
+    if (TR_OK == transaction(t, n, cmd, line)) {
+      result = decode_clear(n, line);
     }
-  } else {
-    result = TR_ERROR;
   }
+  tr_end(t);
 
-  str_free(line);
-  str_free(cmd);
   return result;
 }
 
 int tr_identify(transducer *t, int n)
 {
-  string *model;
-  
-  string *line = str_alloc(NULL, 80);
-  string *cmd = str_alloc(NULL, 20);
+  int result;
 
-  str_sprintf(cmd, 10, "$%02XM\r", n);
-    
-  serial_write(t->fd, cmd);
-  
-  if (SER_OK == serial_readline(t->fd, line)) {
+  string *line;
+  string *cmd;
 
-    if (verbose > 0) {
-      printf("Read transducer name returned '%s'\n", str_getbuf(line));
-    }
-    
-    /* First character has to be ! */
-    if ('!' != str_getc(line, 0)) {
-      return TR_UNKNOWN_MODEL;
-    }
-    
-    /* Get model string */
-    model = str_substring(line, 3, 0);
-    
-    if (0 == str_cmpb(model, "CRD5110-300-25")) {
-      t->transducers[n].type = TR_1PHASE;
-      t->transducers[n].max_volts = 300;
-      t->transducers[n].max_amps = 25;
-      return TR_OK;
-    } else if (0 == str_cmpb(model, "CRD5170-300-5")) {
-      t->transducers[n].type = TR_3PHASE4WIRE;
-      t->transducers[n].max_volts = 300;
-      t->transducers[n].max_amps = 5;
-      return TR_OK;
-    } else {
-      return TR_UNKNOWN_MODEL;
-    }
+  if (TR_OK != buffers(t, &line, &cmd)) {
+    return TR_LOCK;
+  }
+  command(cmd, n, TR_OP_IDENTIFY);
+
+  if (TR_LOCK == (result = transaction(t, n, cmd, line))) {
+    return TR_LOCK;
+  } else if (result == TR_OK) {
+    result = decode_identify(t, n, line);
   } else {
+    result = TR_UNKNOWN_MODEL;
 
-    if (verbose > 0) {
+    if (t->verbose > 0) {
       printf("Read transducer name returned nothing.\n");
     }
+  }
+  return result;
+}
+
+/**
+ * Queues an operation on transducer n for the non-blocking API. Nothing
+ * is sent until tr_process() is called; the callback gets the result once
+ * the operation completed. Returns TR_ERROR if the queue is full or the
+ * handle cannot be used without blocking (replays).
+ */
+int tr_submit(transducer *t, int n, int op, tr_callback *callback, void *arg)
+{
+  int i;
+
+  if (t->ser.fd < 0 || t->ser.replay || t->queue_len == TR_QUEUE
+      || n < 0 || n > 255 || op < TR_OP_IDENTIFY || op > TR_OP_CLEAR) {
+    return TR_ERROR;
+  }
+  i = (t->queue_head + t->queue_len) % TR_QUEUE;
+  t->queue[i].n = n;
+  t->queue[i].op = op;
+  t->queue[i].callback = callback;
+  t->queue[i].arg = arg;
+  t->queue_len++;
+  return TR_OK;
+}
+
+/**
+ * Descriptor to watch for POLLIN while operations are queued.
+ */
+int tr_fd(transducer *t)
+{
+  return t->ser.fd;
+}
+
+/**
+ * Time in ms after which tr_process() has to be called even if the
+ * descriptor did not become readable, 0 if it should be called right
+ * away, or -1 if nothing is queued.
+ */
+int tr_wait_ms(transducer *t)
+{
+  long long left;
+
+  if (t->queue_len == 0) {
+    return -1;
+  }
+  switch (t->state) {
+  case TR_LOCKING:
+    return LOCK_POLL;
+  case TR_REPLY:
+    left = t->deadline - timer_now_ns();
+    return (left <= 0) ? 0 : (int) ((left + 999999) / 1000000);
+  }
+  return 0;
+}
+
+/**
+ * Sends the current command of the operation in progress.
+ */
+static void send_command(transducer *t, int n)
+{
+  str_clear(&t->line);
+  t->op_timeout = reply_timeout(t, n);
+  serial_write(&t->ser, &t->cmd);
+  t->deadline = timer_now_ns() + t->op_timeout * 1000000LL;
+  t->bytes_seen = 0;
+  t->state = TR_REPLY;
+}
+
+/**
+ * Ends the operation in progress and calls its callback.
+ */
+static void complete(transducer *t, int result)
+{
+  int n = t->queue[t->queue_head].n;
+  int op = t->queue[t->queue_head].op;
+  tr_callback *callback = t->queue[t->queue_head].callback;
+  void *arg = t->queue[t->queue_head].arg;
+
+  if (t->state == TR_REPLY) {
+    lock_release(&t->lock);
+  }
+  t->state = TR_IDLE;
+  t->queue_head = (t->queue_head + 1) % TR_QUEUE;
+  t->queue_len--;
+
+  if (op == TR_OP_IDENTIFY && result == TR_ERROR) {
+    result = TR_UNKNOWN_MODEL;
+  }
+  if (callback != NULL) {
+    callback(t, n, op, result, arg);
+  }
+}
+
+/**
+ * Advances the queued operations as far as possible without blocking.
+ * Called when the descriptor of tr_fd() has events (passed as returned
+ * by poll()) or the time of tr_wait_ms() passed. Returns the number of
+ * operations completed.
+ */
+int tr_process(transducer *t, int events)
+{
+  int completed = 0;
+
+  while (t->queue_len > 0) {
+    int n = t->queue[t->queue_head].n;
+    int op = t->queue[t->queue_head].op;
+    long long now = timer_now_ns();
+    int result;
+    int rc;
+
+    if (t->state == TR_IDLE) {
+      str_clear(&t->cmd);
+      command(&t->cmd, n, op);
+      t->step = 0;
+      t->start = now;
+      t->state = TR_LOCKING;
+    }
+
+    if (t->state == TR_LOCKING) {
+      int first = (t->lock.depth == 0);
+
+      rc = lock_try(&t->lock);
+      if (rc == LOCK_WAIT && now - t->start < t->lock.wait * 1000000LL) {
+	break;
+      }
+      if (rc != LOCK_OK) {
+	lock_cancel(&t->lock);
+	transaction_done(t, n, &t->cmd, t->start, TR_LOCK, SER_ERROR,
+			 reply_timeout(t, n));
+	complete(t, TR_LOCK);
+	completed++;
+	continue;
+      }
+      if (first && t->lock.device >= 0) {
+	/* Drop late replies to somebody else's transactions */
+	tcflush(t->ser.fd, TCIFLUSH);
+      }
+      send_command(t, n);
+      continue;
+    }
 
+    /* Waiting for the reply */
+    if (events & (POLLERR | POLLHUP | POLLNVAL)) {
+      rc = SER_ERROR;
+    } else if (SER_AGAIN == (rc = serial_readline_nb(&t->ser, &t->line))) {
+      if (t->ser.bytes_read > t->bytes_seen) {
+	/* Like serial_readline(), the timeout applies between characters */
+	t->bytes_seen = t->ser.bytes_read;
+	t->deadline = now + t->op_timeout * 1000000LL;
+      }
+      if (now < t->deadline) {
+	break;
+      }
+      rc = SER_TIMEOUT;
+    }
+    if (rc != SER_OK) {
+      drop_input(t);
+    }
+    result = (rc == SER_OK) ? TR_OK : TR_ERROR;
+    transaction_done(t, n, &t->cmd, t->start, result, rc, t->op_timeout);
+
+    if (result == TR_OK) {
+      switch (op) {
+      case TR_OP_IDENTIFY:
+	result = decode_identify(t, n, &t->line);
+	break;
+      case TR_OP_READ:
+	result = decode_read(t, n, &t->line);
+	break;
+      case TR_OP_ENERGY:
+	result = decode_energy(t, n, &t->line);
+	break;
+      case TR_OP_CLEAR:
+	if (t->step == 0) {
+	  /* Second command, still holding the bus */
+	  clear_command(t, n, &t->line, &t->cmd);
+	  t->step = 1;
+	  t->start = timer_now_ns();
+	  send_command(t, n);
+	  continue;
+	}
+	result = decode_clear(n, &t->line);
+	break;
+      }
+    }
+    complete(t, result);
+    completed++;
   }
+  return completed;
+}
 
-  return TR_UNKNOWN_MODEL;
+static const struct {
+  int baud;
+  speed_t speed;
+} speeds[] = {
+  { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+  { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+  { 0, 0 }
+};
+
+/**
+ * Sets the baud rate used by tr_open() (default 9600). Returns TR_ERROR
+ * for unsupported rates.
+ */
+int tr_set_baud(transducer *t, int baud)
+{
+  int i;
+
+  for (i = 0; speeds[i].baud != 0; i++) {
+    if (speeds[i].baud == baud) {
+      t->baud = baud;
+      return TR_OK;
+    }
+  }
+  return TR_ERROR;
 }
 
 int tr_open(transducer *t, char *device)
 {
   struct termios options;
+  int fd;
+  int i;
 
   /* Try to open the file */
-  t->fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
-  if (t->fd < 0) {
+  fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
     return TR_DEVICE_OPEN;
   }
 
-  /* Ensure we are the only process accessing this file */
-  if (flock(t->fd, LOCK_EX | LOCK_NB) != 0) {
-    close(t->fd);
+  /* The bus is shared with other processes one transaction at a time,
+     see tr_begin() */
+  if (LOCK_OK != lock_open(&t->lock, device, fd)) {
+    close(fd);
     return TR_LOCK;
   }
+  serial_init(&t->ser, fd);
  
   /* Get current comm parameters */
-  tcgetattr(t->fd, &options);
+  tcgetattr(fd, &options);
 
-  /* Set 9600 baud */
-  cfsetispeed(&options, B9600);
-  cfsetospeed(&options, B9600);
+  for (i = 0; speeds[i].baud != t->baud; i++) ;
+  cfsetispeed(&options, speeds[i].speed);
+  cfsetospeed(&options, speeds[i].speed);
 
   options.c_cflag |= (CLOCAL | CREAD);
   options.c_cflag &= ~PARENB;
@@ -341,19 +972,105 @@ int tr_open(transducer *t, char *device)
   options.c_cc[VTIME] = 0;
   options.c_cc[VMIN] = 0;
 
-  /* Flush buffers and set new options */
-  tcflush(t->fd, TCIFLUSH);
-  tcsetattr(t->fd, TCSANOW, &options);
+  /* Set new options. The input is not flushed here: it may hold the reply
+     to another process's transaction, tr_begin() flushes it once the bus
+     is ours. */
+  tcsetattr(fd, TCSANOW, &options);
 
   return TR_OK;
 }
 
+/**
+ * Opens a capture file instead of a device. The transducer functions
+ * then see the traffic recorded with tr_capture().
+ */
+int tr_open_replay(transducer *t, char *file, int speed)
+{
+  if (SER_OK != serial_replay(&t->ser, file, speed)) {
+    return TR_DEVICE_OPEN;
+  }
+  return TR_OK;
+}
+
+/**
+ * Records all traffic of an open device into a capture file.
+ */
+int tr_capture(transducer *t, char *file)
+{
+  if (SER_OK != serial_capture(&t->ser, file)) {
+    return TR_ERROR;
+  }
+  return TR_OK;
+}
+
+/**
+ * Records a timeline of all transactions into a trace file.
+ */
+int tr_trace(transducer *t, char *file)
+{
+  if (NULL == (t->trace = trace_open(file))) {
+    return TR_ERROR;
+  }
+  trace_track(t->trace, TRACK_BUS, "bus");
+  trace_track(t->trace, TRACK_LOCK, "waiting for the bus");
+  return TR_OK;
+}
+
 void tr_close(transducer *t)
 {
-  flock(t->fd, LOCK_UN);
-  close(t->fd);
+  trace_close(t->trace);
+  t->trace = NULL;
+  /* Queued operations are dropped without their callbacks */
+  t->queue_len = 0;
+  t->state = TR_IDLE;
+  lock_close(&t->lock);
+  serial_close(&t->ser);
+  if (t->ser.fd < 0) {
+    return;
+  }
+  close(t->ser.fd);
+  t->ser.fd = -1;
+}
+
+/**
+ * Waits for exclusive access to the bus, in turn with other processes.
+ * Calls may be nested, the bus is released by the outermost tr_end().
+ * Returns TR_LOCK if the bus stays busy for longer than the lock wait, or
+ * while an operation of the non-blocking API is in progress.
+ */
+int tr_begin(transducer *t)
+{
+  int first = (t->lock.depth == 0);
+
+  if (t->state != TR_IDLE) {
+    /* The non-blocking API owns the bus */
+    return TR_LOCK;
+  }
+
+  if (LOCK_OK != lock_acquire(&t->lock)) {
+    return TR_LOCK;
+  }
+  if (first && t->lock.device >= 0) {
+    /* Drop late replies to somebody else's transactions */
+    tcflush(t->ser.fd, TCIFLUSH);
+  }
+  return TR_OK;
+}
+
+void tr_end(transducer *t)
+{
+  lock_release(&t->lock);
 }
 
+/**
+ * Sets how long (ms) a transaction waits for a busy bus.
+ */
+void tr_set_lock_wait(transducer *t, int ms)
+{
+  t->lock.wait = ms;
+}
+
+
 int tr_scan(transducer *t)
 {
   int i;
@@ -373,17 +1090,24 @@ int tr_reset(transducer *t)
 {
   int success = 0;
 
-  string *line = str_alloc(NULL, 40);
+  string *line;
+  string *cmd;
 
-  serial_writeb(t->fd, "@CEAFW\r");
-  if (SER_OK == serial_readchars(t->fd, line, 10)) {
-    if (0x01 == str_getc(line, 0) &&
-	0x06 == str_getc(line, 1)) {
-      success = 1;
+  if (TR_OK != buffers(t, &line, &cmd)) {
+    return 0;
+  }
+
+  if (TR_OK == tr_begin(t)) {
+    serial_writeb(&t->ser, "@CEAFW\r");
+    if (SER_OK == serial_readchars(&t->ser, line, 10, t->timeout)) {
+      if (0x01 == str_getc(line, 0) &&
+	  0x06 == str_getc(line, 1)) {
+	success = 1;
+      }
     }
+    tr_end(t);
   }
 
-  str_free(line);
   return success;
 }
 
@@ -391,23 +1115,113 @@ int tr_set_address(transducer *t, int address)
 {
   int success = 0;
 
-  string *cmd = str_alloc(NULL, 40);
-  string *line = str_alloc(NULL, 40);
-  string *result = str_alloc(NULL, 40);
+  string *line;
+  string *cmd;
+  char expected[10];
+
+  if (TR_OK != buffers(t, &line, &cmd)) {
+    return 0;
+  }
 
   /* Command */
   str_sprintf(cmd, 12, "%%01%02X000601\r", address);
 
   /* Expected result */
-  str_sprintf(result, 10, "!%02X\r", address);
+  snprintf(expected, sizeof(expected), "!%02X\r", address);
 
-  serial_write(t->fd, cmd);
-  if (SER_OK == serial_readline(t->fd, line)) {
-    success = (0 == str_cmp(line, result));
+  if (TR_OK == transaction(t, address, cmd, line)) {
+    success = (0 == strcmp(str_getbuf(line), expected));
   }
-  str_free(cmd);
-  str_free(line);
-  str_free(result);
 
   return success;
 }
+
+static const char *field_names[TR_FIELDS] = {
+  "voltage1",
+  "current1",
+  "voltage2",
+  "current2",
+  "voltage3",
+  "current3",
+  "real_power",
+  "reactive_power",
+  "power_factor",
+  "frequency",
+  "kwhr",
+  "kvarhr"
+};
+
+const char *tr_field_name(int field)
+{
+  if (field < 0 || field >= TR_FIELDS) {
+    return NULL;
+  }
+  return field_names[field];
+}
+
+int tr_field_lookup(const char *name)
+{
+  int i;
+
+  for (i = 0; i < TR_FIELDS; i++) {
+    if (0 == strcmp(name, field_names[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Returns true if the transducer at address n delivers the given field.
+ * Single phase transducers only have the first voltage and current.
+ */
+int tr_has_field(transducer *t, int n, int field)
+{
+  switch (field) {
+  case TR_VOLTAGE2:
+  case TR_CURRENT2:
+  case TR_VOLTAGE3:
+  case TR_CURRENT3:
+    return t->transducers[n].type == TR_3PHASE4WIRE;
+  default:
+    return field >= 0 && field < TR_FIELDS;
+  }
+}
+
+/**
+ * Returns the last value read for a field, in the integer engineering
+ * units listed in transducer.h.
+ */
+long long tr_value(transducer *t, int n, int field)
+{
+  return t->value[field][n];
+}
+
+/**
+ * Returns the number of integer units per displayed unit of a field
+ * (V, A, W, var, Hz, kWh, kvarh).
+ */
+long long tr_field_unit(int field)
+{
+  switch (field) {
+  case TR_PFACTOR:
+  case TR_KWHR:
+  case TR_KVARHR:
+    return 1000000;
+  default:
+    return 1000;
+  }
+}
+
+/**
+ * Formats a value in displayed units, with all decimals of the integer
+ * representation.
+ */
+int tr_format(char *buf, int size, int field, long long value)
+{
+  long long unit = tr_field_unit(field);
+  long long a = (value < 0) ? -value : value;
+
+  return snprintf(buf, size, "%s%lld.%0*lld", (value < 0) ? "-" : "",
+		  a / unit, (unit == 1000) ? 3 : 6, a % unit);
+}
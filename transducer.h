@@ -6,57 +6,212 @@
 #define __TRANSDUCER_H
 
 #include "string.h"
+#include "serial.h"
+#include "buslock.h"
+#include "trace.h"
 
 #define TR_OK 0
 #define TR_DEVICE_OPEN -1
 #define TR_UNKNOWN_MODEL -2
 #define TR_ERROR -3
 #define TR_LOCK -4
+#define TR_NOMEM -5
 
 #define TR_1PHASE 0
 #define TR_3PHASE3WIRE 1
 #define TR_3PHASE4WIRE 2
 
+/*
+ * Reading fields, see tr_value(). Values are kept as integers in
+ * engineering units: mV, mA, mW, mvar, power factor in millionths, mHz,
+ * mWh and mvarh.
+ */
+#define TR_VOLTAGE1 0
+#define TR_CURRENT1 1
+#define TR_VOLTAGE2 2
+#define TR_CURRENT2 3
+#define TR_VOLTAGE3 4
+#define TR_CURRENT3 5
+#define TR_POWER 6
+#define TR_VARS 7
+#define TR_PFACTOR 8
+#define TR_FREQUENCY 9
+#define TR_KWHR 10
+#define TR_KVARHR 11
+#define TR_FIELDS 12
+
+/* Longest command and reply */
+#define TR_CMD_MAX 20
+#define TR_LINE_MAX 80
+
+/*
+ * Reply latencies are kept per address in a histogram of half octave
+ * buckets (us), from which the timeout is derived when auto timeouts are
+ * enabled: the 99th percentile times TR_TIMEOUT_MARGIN plus the wire time
+ * of the longest reply. Counts are halved every TR_LATENCY_WINDOW replies,
+ * so that the timeout follows a device which slows down.
+ */
+#define TR_LATENCY_BUCKETS 48
+#define TR_LATENCY_WINDOW 128
+#define TR_LATENCY_MIN_SAMPLES 16
+#define TR_TIMEOUT_MARGIN 2
+
+/* Operations of the non-blocking API, see tr_submit() */
+#define TR_OP_IDENTIFY 0
+#define TR_OP_READ 1
+#define TR_OP_ENERGY 2
+#define TR_OP_CLEAR 3
+
+/* Operations which may be queued on a handle */
+#define TR_QUEUE 16
+
+/* States of the non-blocking API */
+#define TR_IDLE 0
+#define TR_LOCKING 1
+#define TR_REPLY 2
+
+/* Decoded fractions of full scale are in millionths */
+#define TR_FRACTION 1000000LL
+
+/* Largest full scale power (mW) including the transformer ratios. Up to
+   ten times full scale in millionths then still fits into a long long. */
+#define TR_SCALE_MAX 900000000000LL
+
+/* Largest range of a model (VA) */
+#define TR_MODEL_VA_MAX (300 * 25)
+
+struct transducer;
+
+/*
+ * Called by tr_process() when a submitted operation completed, with the
+ * result tr_identify(), tr_read(), tr_read_energy() or tr_clear_energy()
+ * would have returned.
+ */
+typedef void tr_callback(struct transducer *t, int n, int op, int result, void *arg);
+
+/*
+ * All state of a bus lives in its handle. Different handles may be used
+ * concurrently from different threads, a single handle may not.
+ */
 struct transducer
 {
-  int fd;
+  serial ser;
+  buslock lock;
+  int verbose;
+
+  /* Timeline of all transactions, NULL if not tracing */
+  trace *trace;
+
+  /* Reply timeout in ms */
+  int timeout;
+
+  /* Bounds of auto timeouts (ms), 0 if disabled */
+  int timeout_min;
+  int timeout_max;
+
+  int baud;
+
+  /* Command and reply of the current transaction, in fixed buffers so
+     that transactions never allocate memory */
+  string cmd;
+  string line;
+  char cmd_buf[TR_CMD_MAX + 1];
+  char line_buf[TR_LINE_MAX + 1];
 
   struct {
+    int timeout;
+
+    /* Reply latencies, the longest reply (bytes) and the timeout
+       derived from them (0 until there are enough samples) */
+    unsigned short latency[TR_LATENCY_BUCKETS];
+    int latency_samples;
+    int reply_max;
+    int auto_timeout;
+
     int type;
     int max_volts;
     int max_amps;
 
-    double voltage_f1;
-    double voltage_f2;
-    double voltage_f3;
-    double current_f1;
-    double current_f2;
-    double current_f3;
-    double power_f;
-    double vars_f;
-    double pfactor_f;
-    double frequency;
+    /* Ratios of external current and voltage transformers */
+    double ct;
+    double pt;
+
+    /* Full scale in mV, mA and mW, including the transformer ratios.
+       Computed when the transducer is identified. */
+    long long scale_volts;
+    long long scale_amps;
+    long long scale_power;
 
     int time_period;
     int kwhr;
     int kvarhr;
 
   } transducers[256];
+
+  /* Operations submitted to the non-blocking API, the first one is in
+     progress */
+  struct {
+    int n;
+    int op;
+    tr_callback *callback;
+    void *arg;
+  } queue[TR_QUEUE];
+  int queue_head;
+  int queue_len;
+
+  /* State of the operation in progress: the step (clearing takes two
+     commands), when it started, its reply timeout (ms) and the time (ns)
+     at which it gives up waiting */
+  int state;
+  int step;
+  long long start;
+  int op_timeout;
+  long long deadline;
+  int bytes_seen;
+
+  /* Last values read, per field and address. Kept apart from the rest,
+     so that a field of all transducers is contiguous. */
+  long long value[TR_FIELDS][256];
 };
 
 typedef struct transducer transducer;
 
 transducer *tr_alloc();
 int tr_open(transducer *t, char *device);
+int tr_open_replay(transducer *t, char *file, int speed);
+int tr_capture(transducer *t, char *file);
+int tr_trace(transducer *t, char *file);
 void tr_close(transducer *t);
+int tr_begin(transducer *t);
+void tr_end(transducer *t);
+void tr_set_lock_wait(transducer *t, int ms);
 int tr_identify(transducer *t, int n);
 int tr_read(transducer *t, int n);
 int tr_read_energy(transducer *t, int n);
 int tr_clear_energy(transducer *t, int n);
+int tr_submit(transducer *t, int n, int op, tr_callback *callback, void *arg);
+int tr_fd(transducer *t);
+int tr_wait_ms(transducer *t);
+int tr_process(transducer *t, int events);
 void tr_free(transducer *t);
 int tr_reset(transducer *t);
 int tr_scan(transducer *t);
 int tr_set_address(transducer *t, int address);
-void tr_set_verbose(int level);
+void tr_set_verbose(transducer *t, int level);
+void tr_set_timeout(transducer *t, int n, int timeout);
+void tr_set_deadline(transducer *t, long long deadline);
+void tr_set_auto_timeout(transducer *t, int min, int max);
+int tr_timeout(transducer *t, int n);
+long long tr_latency(transducer *t, int n, int percent);
+int tr_set_baud(transducer *t, int baud);
+int tr_valid_ratio(double ct, double pt);
+int tr_set_ratio(transducer *t, int n, double ct, double pt);
+int tr_set_model(transducer *t, int n, int type, int max_volts, int max_amps);
+const char *tr_field_name(int field);
+int tr_field_lookup(const char *name);
+int tr_has_field(transducer *t, int n, int field);
+long long tr_value(transducer *t, int n, int field);
+long long tr_field_unit(int field);
+int tr_format(char *buf, int size, int field, long long value);
 
 #endif /* __TRANSDUCER_H */